@@ -37,6 +37,7 @@ static byte bootstrap_rom_data[] = {
 
 constexpr size_t WINDOW_WIDTH = 700;
 constexpr size_t WINDOW_HEIGHT = 800;
+constexpr size_t SCREEN_SCALE = 4;
 
 struct Color
 {
@@ -63,10 +64,12 @@ public:
   void unlock() { locked.clear(std::memory_order_release); }
 };
 
-class GLDisplayer : public LCDDisplayer
+class GLDisplayer : public LCDDisplayer, public framebuffer_owner
 {
 public:
-  GLDisplayer(size_t width, size_t height) : width_(width), height_(height), window_(nullptr), joypad_(nullptr)
+  GLDisplayer(size_t width, size_t height)
+      : width_(width), height_(height), window_(nullptr), joypad_(nullptr),
+        write_(0), ready_(1), shown_(2), fresh_(false)
   {
     new (&palettes_[0]) Color(0xd0, 0xf8, 0xe0);
     new (&palettes_[1]) Color(0x70, 0xc0, 0x88);
@@ -108,12 +111,20 @@ public:
     return true;
   }
 
-  virtual void push_frame(const PixelMap &frame)
+  // triple buffered: the emulation thread fills one frame while the ui thread
+  // draws another, only the indices are swapped under the lock; a frame the
+  // ui thread hasn't taken yet is replaced by the newer one
+  virtual void push_frame(const ScreenFrame &frame)
   {
+    frames_[write_] = frame;
     std::lock_guard<SpinLock> guard(frame_mutex_);
-    frame_list_.push_back(UPtr<PixelMap>(new PixelMap(frame.clone())));
+    std::swap(write_, ready_);
+    fresh_ = true;
   }
 
+  // the window still shows it
+  virtual void repeat_frame() {}
+
   void run()
   {
     debug_log("now ui thread is running!");
@@ -121,19 +132,24 @@ public:
     auto draw_times = 0;
     while (true)
     {
-      UPtr<PixelMap> pm;
+      bool fresh;
       {
         std::lock_guard<SpinLock> guard(frame_mutex_);
-        if (frame_list_.empty())
+        fresh = fresh_;
+        if (fresh_)
         {
-          std::this_thread::sleep_for(std::chrono::milliseconds(5));
-          continue;
+          std::swap(ready_, shown_);
+          fresh_ = false;
         }
-
-        pm = std::move(frame_list_.front());
-        frame_list_.pop_front();
       }
-      render(*pm);
+      if (!fresh)
+      {
+        // still screens push nothing, the keys have to be read anyway
+        glfwPollEvents();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        continue;
+      }
+      render(frames_[shown_]);
       ++draw_times;
       auto now_clock = std::chrono::high_resolution_clock::now();
       auto time_span = std::chrono::duration_cast<std::chrono::duration<double>>(
@@ -188,27 +204,34 @@ private:
                                    action == GLFW_PRESS || action == GLFW_REPEAT);
   }
 
-  void render(const PixelMap &frame)
+  void render(const ScreenFrame &frame)
   {
-    auto pm = frame.magnify(4);
-    GLubyte *screenbmp = (GLubyte *)malloc(pm.width() * pm.height() * 3);
     glClear(GL_COLOR_BUFFER_BIT);
 
-    for (size_t x = 0; x < pm.width(); ++x)
+    // every pixel becomes a SCREEN_SCALE square, bottom row first for GL
+    for (size_t y = 0; y < frame.height(); ++y)
     {
-      for (size_t y = 0; y < pm.height(); ++y)
+      auto pixels = frame.row(y);
+      auto rows = &screenbmp_[(frame.height() - 1 - y) * SCREEN_SCALE];
+      auto out = rows[0];
+      for (size_t x = 0; x < frame.width(); ++x)
+      {
+        assert(pixels[x] < 4);
+        auto color = palettes_[pixels[x]];
+        for (size_t i = 0; i < SCREEN_SCALE; ++i, out += 3)
+        {
+          out[0] = color.red;
+          out[1] = color.green;
+          out[2] = color.blue;
+        }
+      }
+      for (size_t i = 1; i < SCREEN_SCALE; ++i)
       {
-        auto pixel = pm.pixel(x, y);
-        assert(pixel < 4);
-        auto color = palettes_[pixel];
-        auto real_y = pm.height() - 1 - y;
-        screenbmp[real_y * pm.width() * 3 + x * 3 + 0] = color.red;
-        screenbmp[real_y * pm.width() * 3 + x * 3 + 1] = color.green;
-        screenbmp[real_y * pm.width() * 3 + x * 3 + 2] = color.blue;
+        memcpy(rows[i], rows[0], sizeof(rows[0]));
       }
     }
-    glDrawPixels(pm.width(), pm.height(), GL_RGB, GL_UNSIGNED_BYTE, screenbmp);
-    free(screenbmp);
+    glDrawPixels(SCREEN_WIDTH * SCREEN_SCALE, SCREEN_HEIGHT * SCREEN_SCALE,
+                 GL_RGB, GL_UNSIGNED_BYTE, screenbmp_);
     glFlush();
 
     glfwSwapBuffers(window_);
@@ -225,7 +248,14 @@ private:
 
   // std::mutex frame_mutex_;
   SpinLock frame_mutex_;
-  std::list<UPtr<PixelMap>> frame_list_;
+  ScreenFrame frames_[3];
+  int write_;
+  int ready_;
+  int shown_;
+  bool fresh_; // ready_ holds a frame not drawn yet
+
+  GLubyte screenbmp_[SCREEN_HEIGHT * SCREEN_SCALE]
+                    [SCREEN_WIDTH * SCREEN_SCALE * 3];
 };
 
 int main(int argc, char **argv)
@@ -237,18 +267,40 @@ int main(int argc, char **argv)
   }
 
   auto debug_mode = true;
+  auto jit_mode = JitMode::JIT_OFF;
+  auto frame_skip = 0;
+  auto rtc_sync_host = false;
   for (auto i = 1; i < argc; ++i)
   {
     if (!strcmp(argv[i], "-n"))
     {
       debug_mode = false;
     }
+    else if (!strcmp(argv[i], "-j"))
+    {
+      jit_mode = JitMode::JIT_ON;
+    }
+    else if (!strcmp(argv[i], "-jd"))
+    {
+      jit_mode = JitMode::JIT_DIFFERENTIAL;
+    }
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+    {
+      // draw one frame of every n + 1
+      frame_skip = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "-r"))
+    {
+      // the cartridge clock catches up with the time spent since the save
+      rtc_sync_host = true;
+    }
   }
 
   SPtr<BootstrapROM> bsr(new BootstrapROM(bootstrap_rom_data));
 
   std::string rom_path(argv[1]);
-  auto cartridge = CartridgeLoader::load(rom_path);
+  auto cartridge = CartridgeLoader::load(rom_path, SAVE_RAM_FLUSH_INTERVAL,
+                                         rtc_sync_host);
   if (!cartridge)
   {
     std::cerr << "failed to open (" << rom_path.c_str() << ") " << std::endl;
@@ -261,6 +313,8 @@ int main(int argc, char **argv)
 
   VirtualMachine vm(bsr, cartridge, displayer, debug_mode);
   vm.connect_all_components();
+  vm.set_jit_mode(jit_mode);
+  vm.set_frame_skip(frame_skip);
   // vm.run();
   std::thread t(&VirtualMachine::run, &vm);
   displayer->run();
@@ -0,0 +1,126 @@
+#include "pixel_ops.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+/*
+  Checks every pixel kernel the host runs against the plain one, then times
+  them next to the per-pixel decode the renderer used to do: decode_row over
+  every pair of bitplanes and map_palette over screen lines. Exits with 1 when
+  a kernel disagrees with the plain one.
+*/
+
+using namespace GB;
+
+namespace {
+
+constexpr int DECODE_ROUNDS = 100; // each over all 65536 bitplane pairs
+constexpr int LINE_ROUNDS = 1000000;
+constexpr size_t LINE_WIDTH = 160;
+
+// every row of bitplanes and every palette over all colour numbers
+bool same_as_scalar(const PixelOps &scalar, const PixelOps &ops) {
+  for (auto planes = 0; planes < 0x10000; ++planes) {
+    pixel_t row[2][8], flipped[2][8];
+    scalar.decode_row(planes & 0xff, planes >> 8, row[0], flipped[0]);
+    ops.decode_row(planes & 0xff, planes >> 8, row[1], flipped[1]);
+    if (memcmp(row[0], row[1], 8) != 0 ||
+        memcmp(flipped[0], flipped[1], 8) != 0) {
+      return false;
+    }
+  }
+  // long enough for every vector width and a tail after it
+  pixel_t colors[71];
+  for (size_t i = 0; i < sizeof(colors); ++i) {
+    colors[i] = i % 4;
+  }
+  for (auto palette = 0; palette < 0x100; ++palette) {
+    pixel_t shades[2][sizeof(colors)];
+    scalar.map_palette(colors, shades[0], sizeof(colors), palette);
+    ops.map_palette(colors, shades[1], sizeof(colors), palette);
+    if (memcmp(shades[0], shades[1], sizeof(colors)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// a shift and a mask per pixel and orientation
+void decode_row_per_pixel(byte lo, byte hi, pixel_t *row, pixel_t *flipped) {
+  for (auto x = 0; x < 8; ++x) {
+    auto bit = 7 - x;
+    row[x] = (hi >> bit & 1) << 1 | (lo >> bit & 1);
+    flipped[7 - x] = row[x];
+  }
+}
+
+void map_palette_per_pixel(const pixel_t *colors, pixel_t *shades, size_t n,
+                           uint8_t palette) {
+  for (size_t i = 0; i < n; ++i) {
+    shades[i] = palette >> (colors[i] * 2) & 0x3;
+  }
+}
+
+const PixelOps PER_PIXEL = {decode_row_per_pixel, map_palette_per_pixel,
+                            "per-pixel"};
+
+// keeps the results alive
+volatile unsigned sink;
+
+template <class F> double nanoseconds(long n, F f) {
+  auto begin = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - begin).count() / n;
+}
+
+void bench(const PixelOps &ops) {
+  auto decode = nanoseconds(DECODE_ROUNDS * 0x10000l, [&ops] {
+    pixel_t row[8], flipped[8];
+    unsigned sum = 0;
+    for (auto round = 0; round < DECODE_ROUNDS; ++round) {
+      for (auto planes = 0; planes < 0x10000; ++planes) {
+        ops.decode_row(planes & 0xff, planes >> 8, row, flipped);
+        sum += row[planes & 7] + flipped[0];
+      }
+    }
+    sink = sum;
+  });
+
+  pixel_t colors[LINE_WIDTH], shades[LINE_WIDTH];
+  for (size_t i = 0; i < LINE_WIDTH; ++i) {
+    colors[i] = (i * 7 + i / 8) % 4;
+  }
+  auto map = nanoseconds(LINE_ROUNDS, [&] {
+    unsigned sum = 0;
+    for (auto round = 0; round < LINE_ROUNDS; ++round) {
+      ops.map_palette(colors, shades, LINE_WIDTH, round);
+      sum += shades[round % LINE_WIDTH];
+    }
+    sink = sum;
+  });
+  printf("%-10s decode_row %6.2f ns/row  map_palette %7.2f ns/line\n",
+         ops.name, decode, map);
+}
+
+} // namespace
+
+int main() {
+  size_t count = 0;
+  auto ops = supported_pixel_ops(&count);
+  printf("pixel_ops() picks %s\n", pixel_ops().name);
+
+  auto agree = true;
+  for (size_t i = 1; i < count; ++i) {
+    if (!same_as_scalar(ops[0], ops[i])) {
+      printf("%s differs from %s\n", ops[i].name, ops[0].name);
+      agree = false;
+    }
+  }
+
+  bench(PER_PIXEL);
+  for (size_t i = 0; i < count; ++i) {
+    bench(ops[i]);
+  }
+  return agree ? 0 : 1;
+}
@@ -17,6 +17,7 @@ public:
     assert(addr < ROM_DATA_LENGTH);
     return rom_data_[addr];
   }
+  const byte *read_page(a16_t addr) const override { return rom_data_; }
 
 private:
   byte rom_data_[ROM_DATA_LENGTH];
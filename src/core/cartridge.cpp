@@ -1,7 +1,9 @@
 #include "cartridge.h"
 #include "common.h"
+#include "rtc.h"
+#include <algorithm>
 #include <cassert>
-#include <fstream>
+#include <cstring>
 
 namespace GB {
 
@@ -113,6 +115,30 @@ int CartridgeHeader::load(const byte *raw_data) {
   return 0;
 }
 
+bool CartridgeHeader::has_battery() const {
+  switch (cartridge_type_) {
+  case CartridgeType::MBC1_RAM_BATTERY:
+  case CartridgeType::MBC2_BATTERY:
+  case CartridgeType::ROM_RAM_BATTERY:
+  case CartridgeType::MMM01_RAM_BATTERY:
+  case CartridgeType::MBC3_TIMER_BATTERY:
+  case CartridgeType::MBC3_TIMER_RAM_BATTERY:
+  case CartridgeType::MBC3_RAM_BATTERY:
+  case CartridgeType::MBC4_RAM_BATTERY:
+  case CartridgeType::MBC5_RAM_BATTERY:
+  case CartridgeType::MBC5_RUMBLE_RAM_BATTERY:
+  case CartridgeType::HuC1_RAM_BATTERY:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool CartridgeHeader::has_timer() const {
+  return cartridge_type_ == CartridgeType::MBC3_TIMER_BATTERY ||
+         cartridge_type_ == CartridgeType::MBC3_TIMER_RAM_BATTERY;
+}
+
 std::string CartridgeHeader::description() const {
   char buf[1024];
   std::string type_name;
@@ -217,17 +243,19 @@ std::string CartridgeHeader::description() const {
 }
 
 //=============================cartridge=============================
-Cartridge::Cartridge(CartridgeHeaderSP header, ByteArraySP rom_data)
-    : header_(header), rom_data_(std::move(rom_data)) {
-  if (header_->ram_size() > 0) {
-    ram_data_ = ByteArraySP(new byte[header_->ram_size()]);
-  }
-}
+Cartridge::Cartridge(CartridgeHeaderSP header, ROMImagePtr rom,
+                     SaveRAMPtr ram)
+    : header_(header), rom_(rom), rom_data_(rom->data()), ram_(std::move(ram)),
+      ram_data_(ram_ ? ram_->data() : nullptr),
+      banks_{rom_data_ + ROM_BANK_SIZE, nullptr, nullptr, 0},
+      bank_generation_(0) {}
 //==========================MBC implementation========================
+constexpr size_t MBC2_RAM_SIZE = 0x200;
+
 class ROMOnlyCartridge : public Cartridge {
 public:
-  ROMOnlyCartridge(CartridgeHeaderSP header, ByteArraySP rom_data)
-      : Cartridge(header, std::move(rom_data)) {}
+  ROMOnlyCartridge(CartridgeHeaderSP header, ROMImagePtr rom)
+      : Cartridge(header, rom, SaveRAMPtr()) {}
 
   void set(a16_t addr, byte data) override {
     // nothing to do
@@ -235,22 +263,126 @@ public:
 
   byte get(a16_t addr) const override {
     assert(addr < header_->rom_size());
-    return static_cast<byte>(rom_data_[addr]);
+    return rom_data_[addr];
   }
 };
 
-class MBC1Cartridge : public Cartridge {
+/*
+  Cartridges with switchable banks. A bank-select write that changes the banks
+  recomputes the base pointers of 4000-7FFF and A000-BFFF once, every read
+  after that is a single add off them. A null RAM bank means A000-BFFF is
+  disabled or belongs to something else, the mapper's get_ram / set_ram take
+  those.
+*/
+class BankedCartridge : public Cartridge {
+public:
+  BankedCartridge(CartridgeHeaderSP header, ROMImagePtr rom, SaveRAMPtr ram)
+      : Cartridge(header, rom, std::move(ram)),
+        rom_banks_num_(rom->size() / ROM_BANK_SIZE),
+        ram_banks_num_(ram_ ? (ram_->size() + RAM_BANK_SIZE - 1) /
+                                  RAM_BANK_SIZE
+                            : 0),
+        ram_bank_size_(ram_ ? std::min(ram_->size(), RAM_BANK_SIZE) : 0),
+        rom_bank_(1), ram_bank_(nullptr) {}
+
+  void set(a16_t addr, byte data) override {
+    if (addr < 0x8000) {
+      control(addr, data);
+    } else if (addr >= 0xA000 && addr < 0xC000) {
+      set_ram(addr, data);
+    } else {
+      assert(0);
+    }
+  }
+
+  byte get(a16_t addr) const override {
+    if (addr < 0x4000) {
+      return rom_data_[addr];
+    } else if (addr < 0x8000) {
+      return banks_.rom[addr - 0x4000];
+    } else if (addr >= 0xA000 && addr < 0xC000) {
+      return get_ram(addr);
+    }
+    assert(0);
+    return 0;
+  }
+
+  size_t rom_bank() const override { return rom_bank_; }
+
+protected:
+  // writes to 0000-7FFF
+  virtual void control(a16_t addr, byte data) = 0;
+
+  virtual byte get_ram(a16_t addr) const {
+    auto ram = ram_page(addr);
+    return ram ? *ram : 0xFF;
+  }
+
+  virtual void set_ram(a16_t addr, byte data) {
+    auto ram = ram_page(addr);
+    if (ram) {
+      *ram = data;
+      if (ram_->battery()) {
+        ram_->mark_dirty(ram - ram_data_);
+      }
+    }
+  }
+
+  // banks past the end of the ROM wrap around like the unconnected lines
+  void select_rom_bank(size_t bank) {
+    bank %= rom_banks_num_;
+    if (bank == rom_bank_) {
+      return;
+    }
+    rom_bank_ = bank;
+    banks_.rom = rom_data_ + rom_bank_ * ROM_BANK_SIZE;
+    ++bank_generation_;
+  }
+
+  void select_ram_bank(bool enabled, size_t bank) {
+    byte *ram = nullptr;
+    if (enabled && ram_banks_num_ > 0) {
+      ram = &ram_data_[(bank % ram_banks_num_) * RAM_BANK_SIZE];
+    }
+    if (ram == ram_bank_) {
+      return;
+    }
+    ram_bank_ = ram;
+    // writes to battery-backed RAM have to be seen to be saved
+    banks_.ram_read = ram;
+    banks_.ram_write = ram && !ram_->battery() ? ram : nullptr;
+    banks_.ram_size = ram ? ram_bank_size_ : 0;
+    ++bank_generation_;
+  }
+
+  byte *ram_page(a16_t addr) const {
+    auto offset = addr - 0xA000u;
+    return ram_bank_ && offset < ram_bank_size_ ? ram_bank_ + offset
+                                                : nullptr;
+  }
+
+private:
+  size_t rom_banks_num_;
+  size_t ram_banks_num_;
+  size_t ram_bank_size_;
+
+  size_t rom_bank_;
+  byte *ram_bank_;
+};
+
+class MBC1Cartridge : public BankedCartridge {
   enum BankingMode {
     ROMMode,
     RAMMode,
   };
 
 public:
-  MBC1Cartridge(CartridgeHeaderSP header, ByteArraySP rom_data)
-      : Cartridge(header, std::move(rom_data)), ram_enabled_(false),
+  MBC1Cartridge(CartridgeHeaderSP header, ROMImagePtr rom, SaveRAMPtr ram)
+      : BankedCartridge(header, rom, std::move(ram)), ram_enabled_(false),
         lower_data_(1), upper_data_(0), banking_mode_(BankingMode::ROMMode) {}
 
-  void set(a16_t addr, byte data) override {
+protected:
+  void control(a16_t addr, byte data) override {
     if (addr < 0x2000) {
       ////0xA means enabling RAM
       ram_enabled_ = ((data & 0xf) == 0xA);
@@ -261,90 +393,297 @@ public:
         lower_data_ = 1;
       }
     } else if (addr < 0x6000) {
-      // ram bank number or rom bank number - 2 bits
+      // ram bank number or upper bits of rom bank number - 2 bits
       upper_data_ = data & 0x3;
-    } else if (addr < 0x8000) {
+    } else {
       banking_mode_ =
           IS_BIT_SET(data, 0) ? BankingMode::RAMMode : BankingMode::ROMMode;
-    } else if (addr >= 0xA000 && addr < 0xC000) {
-      ram_data_[get_ram_addr(addr)] = data;
+    }
+    select_rom_bank((upper_data_ << 5) | lower_data_);
+    select_ram_bank(ram_enabled_,
+                    banking_mode_ == BankingMode::RAMMode ? upper_data_ : 0);
+  }
+
+private:
+  bool ram_enabled_;
+  uint8_t lower_data_;
+  uint8_t upper_data_;
+  BankingMode banking_mode_;
+};
+
+/*
+  MBC2 has 512 half-bytes of RAM built in, repeated over A000-BFFF. The upper
+  half of every byte reads as ones, so the RAM is never mapped straight.
+*/
+class MBC2Cartridge : public BankedCartridge {
+public:
+  MBC2Cartridge(CartridgeHeaderSP header, ROMImagePtr rom, SaveRAMPtr ram)
+      : BankedCartridge(header, rom, std::move(ram)), ram_enabled_(false) {}
+
+protected:
+  void control(a16_t addr, byte data) override {
+    if (addr >= 0x4000) {
+      return;
+    }
+    // bit 8 of the address tells the two registers apart
+    if (IS_BIT_SET(addr, 8)) {
+      auto bank = data & 0xf;
+      select_rom_bank(bank ? bank : 1);
     } else {
-      assert(0);
+      ram_enabled_ = ((data & 0xf) == 0xA);
     }
   }
 
-  byte get(a16_t addr) const override {
-    if (addr < 0x4000) {
-      return rom_data_[addr];
-    } else if (addr < 0x8000) {
-      return rom_data_[(addr - 0x4000) + get_rom_banks_num() * 0x4000];
-    } else if (addr >= 0xA000 && addr < 0xC000) {
-      return ram_data_[get_ram_addr(addr)];
+  byte get_ram(a16_t addr) const override {
+    return ram_enabled_ ? ram_data_[addr & (MBC2_RAM_SIZE - 1)] | 0xf0
+                        : 0xFF;
+  }
+
+  void set_ram(a16_t addr, byte data) override {
+    if (!ram_enabled_) {
+      return;
+    }
+    auto offset = addr & (MBC2_RAM_SIZE - 1);
+    ram_data_[offset] = data & 0xf;
+    if (ram_->battery()) {
+      ram_->mark_dirty(offset);
     }
-    assert(0);
-    return 0;
+  }
+
+private:
+  bool ram_enabled_;
+};
+
+/*
+  Selecting 08-0C instead of a RAM bank puts a clock register at A000-BFFF,
+  reads come from the copy taken by writing 0 then 1 to 6000-7FFF. The clock
+  is saved after the RAM in the .sav file, on every latch and on the way out.
+*/
+class MBC3Cartridge : public BankedCartridge {
+public:
+  MBC3Cartridge(CartridgeHeaderSP header, ROMImagePtr rom, SaveRAMPtr ram,
+                bool rtc_sync_host)
+      : BankedCartridge(header, rom, std::move(ram)), ram_enabled_(false),
+        has_rtc_(header->has_timer()), ram_select_(0), latch_(0xff) {
+    if (rtc_saved()) {
+      rtc_.load(ram_->trailer(), rtc_sync_host);
+    }
+  }
+
+  ~MBC3Cartridge() { save_rtc(); }
+
+  void connect(const Scheduler *scheduler) override {
+    rtc_.connect(scheduler);
   }
 
 protected:
-  size_t get_rom_banks_num() const {
-    if (banking_mode_ == BankingMode::ROMMode) {
-      return (upper_data_ << 5) | lower_data_;
+  void control(a16_t addr, byte data) override {
+    if (addr < 0x2000) {
+      ram_enabled_ = ((data & 0xf) == 0xA);
+    } else if (addr < 0x4000) {
+      auto bank = data & 0x7f;
+      select_rom_bank(bank ? bank : 1);
+    } else if (addr < 0x6000) {
+      ram_select_ = data;
     } else {
-      return lower_data_;
+      if (latch_ == 0 && data == 1 && has_rtc_) {
+        rtc_.latch();
+        save_rtc();
+      }
+      latch_ = data;
     }
+    select_ram_bank(ram_enabled_ && ram_select_ < 0x8, ram_select_);
   }
 
-  size_t get_ram_addr(a16_t addr) const {
-    addr -= 0xA000;
-    assert(ram_enabled_ && addr < header_->ram_size());
+  byte get_ram(a16_t addr) const override {
+    if (ram_select_ < 0x8) {
+      return BankedCartridge::get_ram(addr);
+    }
+    if (!ram_enabled_ || !rtc_selected()) {
+      return 0xFF;
+    }
+    return rtc_.get(ram_select_ - 0x8);
+  }
 
-    if (header_->ram_banks_num() > 0) {
-      auto bn = 0;
-      if (banking_mode_ == BankingMode::RAMMode) {
-        bn = upper_data_;
-      }
-      return addr + bn * 0x2000;
-    } else {
-      return addr;
+  void set_ram(a16_t addr, byte data) override {
+    if (ram_select_ < 0x8) {
+      BankedCartridge::set_ram(addr, data);
+      return;
+    }
+    if (ram_enabled_ && rtc_selected()) {
+      rtc_.set(ram_select_ - 0x8, data);
     }
   }
 
+private:
+  bool rtc_selected() const { return has_rtc_ && ram_select_ <= 0xC; }
+  bool rtc_saved() const { return has_rtc_ && ram_ && ram_->battery(); }
+
+  void save_rtc() {
+    if (!rtc_saved()) {
+      return;
+    }
+    rtc_.save(ram_->trailer());
+    ram_->mark_dirty(ram_->size());
+    ram_->mark_dirty(ram_->size() + RTC_STATE_SIZE - 1);
+  }
+
+private:
+  bool ram_enabled_;
+  bool has_rtc_;
+  uint8_t ram_select_;
+  uint8_t latch_;
+  RTC rtc_;
+};
+
+class MBC5Cartridge : public BankedCartridge {
+public:
+  MBC5Cartridge(CartridgeHeaderSP header, ROMImagePtr rom, SaveRAMPtr ram)
+      : BankedCartridge(header, rom, std::move(ram)), ram_enabled_(false),
+        rom_lower_(1), rom_upper_(0), ram_select_(0), rumble_(false) {
+    auto type = header->type();
+    has_rumble_ = type == CartridgeType::MBC5_RUMBLE ||
+                  type == CartridgeType::MBC5_RUMBLE_RAM ||
+                  type == CartridgeType::MBC5_RUMBLE_RAM_BATTERY;
+  }
+
+  bool rumble() const override { return rumble_; }
+
 protected:
+  void control(a16_t addr, byte data) override {
+    if (addr < 0x2000) {
+      ram_enabled_ = ((data & 0xf) == 0xA);
+    } else if (addr < 0x3000) {
+      // unlike the others, bank 0 can be mapped at 4000-7FFF
+      rom_lower_ = data;
+    } else if (addr < 0x4000) {
+      rom_upper_ = data & 0x1;
+    } else if (addr < 0x6000) {
+      // bit 3 drives the motor on rumble cartridges
+      if (has_rumble_) {
+        rumble_ = IS_BIT_SET(data, 3);
+        ram_select_ = data & 0x7;
+      } else {
+        ram_select_ = data & 0xf;
+      }
+    }
+    select_rom_bank(rom_upper_ << 8 | rom_lower_);
+    select_ram_bank(ram_enabled_, ram_select_);
+  }
+
+private:
   bool ram_enabled_;
-  uint8_t lower_data_;
-  uint8_t upper_data_;
-  BankingMode banking_mode_;
+  bool has_rumble_;
+  uint8_t rom_lower_;
+  uint8_t rom_upper_;
+  uint8_t ram_select_;
+  bool rumble_;
 };
 
-CartridgePtr CartridgeLoader::load(std::string rom_path) {
-  std::ifstream is(rom_path.c_str(), std::ifstream::binary);
-  if (!is) {
-    return CartridgePtr();
+/*
+  HuC1 swaps its RAM for an infrared port when 0E is written to 0000-1FFF.
+  There is no other side to talk to, the port never sees light.
+*/
+class HuC1Cartridge : public BankedCartridge {
+public:
+  HuC1Cartridge(CartridgeHeaderSP header, ROMImagePtr rom, SaveRAMPtr ram)
+      : BankedCartridge(header, rom, std::move(ram)), ir_mode_(false),
+        ram_select_(0) {
+    select_ram_bank(true, 0);
+  }
+
+protected:
+  void control(a16_t addr, byte data) override {
+    if (addr < 0x2000) {
+      ir_mode_ = ((data & 0xf) == 0xE);
+    } else if (addr < 0x4000) {
+      auto bank = data & 0x3f;
+      select_rom_bank(bank ? bank : 1);
+    } else if (addr < 0x6000) {
+      ram_select_ = data & 0x3;
+    }
+    select_ram_bank(!ir_mode_, ram_select_);
+  }
+
+  byte get_ram(a16_t addr) const override {
+    return ir_mode_ ? 0xC0 : BankedCartridge::get_ram(addr);
+  }
+
+  void set_ram(a16_t addr, byte data) override {
+    // the IR LED is write-only and goes nowhere
+    if (!ir_mode_) {
+      BankedCartridge::set_ram(addr, data);
+    }
   }
 
-  // get length of file:
-  is.seekg(0, is.end);
-  int length = is.tellg();
-  is.seekg(0, is.beg);
+private:
+  bool ir_mode_;
+  uint8_t ram_select_;
+};
 
-  ByteArraySP buffer(new byte[length]);
-  is.read(reinterpret_cast<char *>(buffer.get()), length);
-  is.close();
+CartridgePtr CartridgeLoader::load(std::string rom_path,
+                                   int save_flush_interval,
+                                   bool rtc_sync_host) {
+  auto rom = ROMImage::load(rom_path);
+  if (!rom) {
+    return CartridgePtr();
+  }
 
   // parse the cartridge header
   auto header = new CartridgeHeader();
   CartridgeHeaderSP header_sp(header);
-  if (header->load(buffer.get())) {
+  if (header->load(rom->data())) {
     return CartridgePtr();
   }
 
+  // MBC2 has its RAM built in, the header says none
+  auto ram_size = header->ram_size();
+  if (header->type() == CartridgeType::MBC2 ||
+      header->type() == CartridgeType::MBC2_BATTERY) {
+    ram_size = MBC2_RAM_SIZE;
+  }
+  SaveRAMPtr ram;
+  // the MBC3 clock keeps its state after the RAM
+  auto trailer = header->has_timer() ? RTC_STATE_SIZE : 0;
+  if ((ram_size > 0 || trailer > 0) && header->has_battery()) {
+    // game.gb saves to game.sav
+    auto name = rom_path.find_last_of("/\\");
+    auto dot = rom_path.find_last_of('.');
+    if (dot == std::string::npos || (name != std::string::npos && dot < name)) {
+      dot = rom_path.size();
+    }
+    ram.reset(new SaveRAM(ram_size, rom_path.substr(0, dot) + ".sav",
+                          save_flush_interval, trailer));
+  } else if (ram_size > 0) {
+    ram.reset(new SaveRAM(ram_size));
+  }
+
   switch (header_sp->type()) {
   case CartridgeType::ROM_ONLY:
-    return CartridgePtr(new ROMOnlyCartridge(header_sp, std::move(buffer)));
+    return CartridgePtr(new ROMOnlyCartridge(header_sp, rom));
   case CartridgeType::MBC1:
   case CartridgeType::MBC1_RAM:
   case CartridgeType::MBC1_RAM_BATTERY:
-    return CartridgePtr(new MBC1Cartridge(header_sp, std::move(buffer)));
+    return CartridgePtr(new MBC1Cartridge(header_sp, rom, std::move(ram)));
+  case CartridgeType::MBC2:
+  case CartridgeType::MBC2_BATTERY:
+    return CartridgePtr(new MBC2Cartridge(header_sp, rom, std::move(ram)));
+  case CartridgeType::MBC3_TIMER_BATTERY:
+  case CartridgeType::MBC3_TIMER_RAM_BATTERY:
+  case CartridgeType::MBC3:
+  case CartridgeType::MBC3_RAM:
+  case CartridgeType::MBC3_RAM_BATTERY:
+    return CartridgePtr(new MBC3Cartridge(header_sp, rom, std::move(ram),
+                                              rtc_sync_host));
+  case CartridgeType::MBC5:
+  case CartridgeType::MBC5_RAM:
+  case CartridgeType::MBC5_RAM_BATTERY:
+  case CartridgeType::MBC5_RUMBLE:
+  case CartridgeType::MBC5_RUMBLE_RAM:
+  case CartridgeType::MBC5_RUMBLE_RAM_BATTERY:
+    return CartridgePtr(new MBC5Cartridge(header_sp, rom, std::move(ram)));
+  case CartridgeType::HuC1_RAM_BATTERY:
+    return CartridgePtr(new HuC1Cartridge(header_sp, rom, std::move(ram)));
   default:
     return CartridgePtr();
   }
@@ -2,12 +2,16 @@
 
 #include "hardware.h"
 #include "memory_operator.h"
+#include "rom_image.h"
+#include "save_ram.h"
 #include <cassert>
 #include <memory>
 #include <string>
 
 namespace GB {
 
+class Scheduler;
+
 /*
   00h  ROM ONLY                 13h  MBC3+RAM+BATTERY
   01h  MBC1                     15h  MBC4
@@ -85,6 +89,8 @@ public:
   size_t ram_banks_num() const { return ram_banks_num_; }
   uint8_t destination_code() const { return destination_code_; }
   uint8_t version() const { return version_number_; }
+  bool has_battery() const;
+  bool has_timer() const;
 
   std::string description() const;
 
@@ -105,26 +111,60 @@ private:
 };
 
 typedef std::shared_ptr<const CartridgeHeader> CartridgeHeaderSP;
-typedef std::unique_ptr<byte[]> ByteArraySP;
+constexpr size_t RAM_BANK_SIZE = 0x2000;
 
 class Cartridge : public MemoryOperator {
 public:
-  Cartridge(CartridgeHeaderSP header, ByteArraySP rom_data);
+  Cartridge(CartridgeHeaderSP header, ROMImagePtr rom, SaveRAMPtr ram);
   ~Cartridge() = default;
 
   CartridgeHeaderSP header() const { return header_; }
+  // only 0000-3FFF, the switchable ranges are mapped from banks()
+  const byte *read_page(a16_t addr) const override {
+    return addr < 0x4000 ? &rom_data_[addr] : nullptr;
+  }
+  // the ROM bank currently mapped at 4000-7FFF
+  virtual size_t rom_bank() const { return 1; }
+  // whether the rumble motor of an MBC5 cartridge is running
+  virtual bool rumble() const { return false; }
+  // the clock cartridge hardware counts, nullptr when the machine goes away
+  virtual void connect(const Scheduler *scheduler) {}
+
+  // where the switchable 4000-7FFF and A000-BFFF are in host memory. The RAM
+  // is mapped for ram_size bytes from A000, a null pointer sends the accesses
+  // through get / set instead
+  struct Banks {
+    const byte *rom;
+    const byte *ram_read;
+    byte *ram_write;
+    size_t ram_size;
+  };
+  const Banks &banks() const { return banks_; }
+  // bumped whenever banks() changes, so bank-select writes that keep the same
+  // banks cost no remapping
+  uint32_t bank_generation() const { return bank_generation_; }
 
 protected:
   CartridgeHeaderSP header_;
-  ByteArraySP rom_data_;
-  ByteArraySP ram_data_;
+  ROMImagePtr rom_;
+  const byte *rom_data_;
+  SaveRAMPtr ram_; // null for cartridges without RAM
+  byte *ram_data_;
+  Banks banks_;
+  uint32_t bank_generation_;
 };
 
 typedef std::shared_ptr<Cartridge> CartridgePtr;
 
 class CartridgeLoader final {
 public:
-  static CartridgePtr load(std::string rom_path);
+  // battery-backed RAM is kept in the .sav file next to the ROM, flushed
+  // every save_flush_interval ms. A clock cartridge catches up with the time
+  // the host spent since the save when rtc_sync_host, otherwise it carries on
+  // from where it was saved and replays stay deterministic
+  static CartridgePtr load(std::string rom_path,
+                           int save_flush_interval = SAVE_RAM_FLUSH_INTERVAL,
+                           bool rtc_sync_host = false);
 };
 
 } // namespace GB
\ No newline at end of file
@@ -1,9 +1,18 @@
 #include "cpu.h"
+#include "instruction_cache.h"
 #include "instruction_decoder.h"
+#include "instruction_table.h"
+#include "jit_compiler.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
 namespace GB {
+// executions of a ROM block before it gets compiled
+constexpr uint32_t JIT_HOT_BLOCK_THRESHOLD = 16;
+// longest fast-forward of a halted or idling CPU, so the host still gets a
+// look in (joypad) at least once per frame
+constexpr int MAX_IDLE_CLOCKS = 70224;
 
 std::string CPU::reg_name(CPURegister reg) {
   switch (reg) {
@@ -55,171 +64,178 @@ std::string CPU::condition_name(JumpCC cc) {
 }
 
 CPU::CPU(Memory *memory, bool debug_mode)
-    : debug_mode_(debug_mode), _memory(memory), double_speed_mode_(false),
-      clock_frequency_(NORMAL_CLOCK_FREQUENCY), halted_(false), _ime(false),
-      _interrupt_enable(0), _interrupt_flags(0), timer_(new Timer()) {
-  memset(_registers, 0, sizeof(_registers));
-  memory->map_port(MappedIOPorts::REG_DIV, timer_.get());
-  memory->map_port(MappedIOPorts::REG_TIMA, timer_.get());
-  memory->map_port(MappedIOPorts::REG_TMA, timer_.get());
-  memory->map_port(MappedIOPorts::REG_TAC, timer_.get());
+    : debug_mode_(debug_mode), flags_op_(LAZY_FLAGS_NONE), flags_dest_(0),
+      flags_src_(0), flags_carry_(0), _memory(memory),
+      code_cache_(new InstructionCache(this, memory)),
+      scheduler_(new Scheduler()),
+      double_speed_mode_(false), clock_frequency_(NORMAL_CLOCK_FREQUENCY),
+      halted_(false), halt_bug_(false), stopped_(false), _ime(false),
+      ei_delay_(0), _interrupt_enable(0), _interrupt_flags(IF_UNUSED_BITS),
+      pending_(0),
+      timer_(new Timer(this, scheduler_.get())) {
+  memset(&_registers, 0, sizeof(_registers));
+  memory->connect_code_cache(code_cache_.get());
+  memory->map_port<CPU, &CPU::set_ie>(MappedIOPorts::REG_IE, this,
+                                      &_interrupt_enable);
+  memory->map_port<CPU, &CPU::set_if>(MappedIOPorts::REG_IF, this,
+                                      &_interrupt_flags);
+  timer_->connect(memory);
 }
 
 CPU::~CPU() {}
 
-reg16_t CPU::reg(CPURegister r) const {
-  if (REG_MIN <= r && r < REG_MAX) {
-    return _registers[r];
+reg8_t CPU::compute_flags() const {
+  // the low nibble is kept as it is, just like set_flag does
+  reg8_t f = flag_reg() & 0x0F;
+  unsigned dest = flags_dest_, src = flags_src_, carry = flags_carry_;
+  switch (flags_op_) {
+  case LAZY_FLAGS_NONE:
+    return flag_reg();
+  case LAZY_FLAGS_ADD:
+    f |= ((dest + src + carry) & 0xff) == 0 ? 0x80 : 0;
+    f |= ((dest & 0xf) + (src & 0xf) + carry) & 0x10 ? 0x20 : 0;
+    f |= dest + src + carry > 0xff ? 0x10 : 0;
+    break;
+  case LAZY_FLAGS_SUB:
+    f |= ((dest - src - carry) & 0xff) == 0 ? 0x80 : 0;
+    f |= 0x40;
+    f |= (dest & 0xf) < (src & 0xf) + carry ? 0x20 : 0;
+    f |= dest < src + carry ? 0x10 : 0;
+    break;
+  case LAZY_FLAGS_INC:
+    f = flag_reg() & 0x1F;
+    f |= ((dest + 1) & 0xff) == 0 ? 0x80 : 0;
+    f |= (dest & 0xf) == 0xf ? 0x20 : 0;
+    break;
+  case LAZY_FLAGS_DEC:
+    f = flag_reg() & 0x1F;
+    f |= dest == 1 ? 0x80 : 0;
+    f |= 0x40;
+    f |= (dest & 0xf) == 0 ? 0x20 : 0;
+    break;
+  case LAZY_FLAGS_ZERO:
+    f |= dest == 0 ? 0x80 : 0;
+    f |= src & 0x70;
+    break;
   }
+  return f;
+}
+
+reg16_t CPU::reg(CPURegister r) const {
   switch (r) {
+  case REG_F:
+    return flags();
   case REG_AF:
-    return (_registers[REG_A] << 8) | _registers[REG_F];
-  case REG_BC:
-    return (_registers[REG_B] << 8) | _registers[REG_C];
-  case REG_DE:
-    return (_registers[REG_D] << 8) | _registers[REG_E];
-  case REG_HL:
-    return (_registers[REG_H] << 8) | _registers[REG_L];
-  default:
+    return reg<REG_AF>();
+  case REG_MAX:
     assert(0);
+    return 0;
+  default:
+    return is_reg8(r) ? _registers.r8[reg8_index(r)]
+                      : _registers.r16[reg16_index(r)];
   }
-  return 0;
 }
 
 void CPU::reg(CPURegister r, reg16_t v) {
   switch (r) {
-  case REG_A:
   case REG_F:
-  case REG_B:
-  case REG_C:
-  case REG_D:
-  case REG_E:
-  case REG_H:
-  case REG_L:
-    _registers[r] = v & 0xff;
-    break;
-  case REG_SP:
-  case REG_PC:
-    _registers[r] = v;
+    reg<REG_F>(v);
     break;
   case REG_AF:
-    _registers[REG_A] = v >> 8;
-    _registers[REG_F] = v & 0xF0;
-    break;
-  case REG_BC:
-    _registers[REG_B] = v >> 8;
-    _registers[REG_C] = v & 0xFF;
-    break;
-  case REG_DE:
-    _registers[REG_D] = v >> 8;
-    _registers[REG_E] = v & 0xFF;
+    reg<REG_AF>(v);
     break;
-  case REG_HL:
-    _registers[REG_H] = v >> 8;
-    _registers[REG_L] = v & 0xFF;
+  case REG_MAX:
+    assert(0);
     break;
   default:
-    assert(0);
+    if (is_reg8(r)) {
+      _registers.r8[reg8_index(r)] = v & 0xff;
+    } else {
+      _registers.r16[reg16_index(r)] = v;
+    }
     break;
   }
 }
 
-byte CPU::memory(size_t index) const {
-  switch (index) {
-  case MappedIOPorts::REG_IE:
-    return _interrupt_enable;
-  case MappedIOPorts::REG_IF:
-    return _interrupt_flags;
-  }
-  return _memory->get(index);
-}
+byte CPU::memory(size_t index) const { return _memory->get(index); }
 
-void CPU::memory(size_t index, byte v) {
-  switch (index) {
-  case MappedIOPorts::REG_IE:
-    set_ie(v);
-    return;
-  case MappedIOPorts::REG_IF:
-    set_if(v);
-    return;
-  }
-  _memory->set(index, v);
-}
+void CPU::memory(size_t index, byte v) { _memory->set(index, v); }
 
 reg16_t CPU::pop() {
-  reg16_t addr = _registers[CPURegister::REG_SP];
+  reg16_t addr = reg<REG_SP>();
   assert(uint32_t(addr) + 2 <= 0xFFFE);
   reg16_t v = _memory->get(addr + 1);
   v = (v << 8) | _memory->get(addr);
-  _registers[CPURegister::REG_SP] = addr + 2;
+  reg<REG_SP>(addr + 2);
   return v;
 }
 
 void CPU::push(reg16_t v) {
-  reg16_t addr = _registers[CPURegister::REG_SP];
+  reg16_t addr = reg<REG_SP>();
   assert(addr >= 2);
   addr -= 2;
   _memory->set(addr, v & 0xff);
   _memory->set(addr + 1, v >> 8);
-  _registers[CPURegister::REG_SP] = addr;
+  reg<REG_SP>(addr);
 }
 
 void CPU::set_ie(uint8_t data) {
-  assert(data < MAX_INTERRUPT_VALUE);
-  _interrupt_enable = data;
+  _interrupt_enable = data & MAX_INTERRUPT_VALUE;
+  update_pending();
 }
 
 void CPU::set_if(uint8_t data) {
-  assert(data < MAX_INTERRUPT_VALUE);
-  _interrupt_flags = data;
+  // the unused top bits always read back as 1
+  _interrupt_flags = (data & MAX_INTERRUPT_VALUE) | IF_UNUSED_BITS;
+  update_pending();
 }
 
-void CPU::handle_interrupts() {
-  // if the [IME] is disabled and it's in the haled status,interrupt just wakeup
-  // the halt status,and nothing else happens(flag will not be reset)
-  if (!_ime && !halted_) {
-    return;
-  }
-
-  constexpr a16_t int_vecs[] = {0x40, 0x48, 0x50, 0x58, 0x60};
-
-  int i = CPUInterrupts::INT_V_BLANK;
-  for (; i <= CPUInterrupts::INT_JOYPAD; ++i) {
-    if (!IS_BIT_SET(_interrupt_enable, i)) {
-      continue;
+void CPU::service_interrupts() {
+  if (ei_delay_ > 0) {
+    // the batch ended right after EI, the next one runs a single instruction
+    // and IME is set after it
+    if (--ei_delay_ > 0) {
+      return;
     }
-    if (!IS_BIT_SET(_interrupt_flags, i)) {
-      continue;
+    _ime = true;
+    update_pending();
+    if (pending_ == 0) {
+      return;
     }
-    break;
-  }
-
-  if (i == CPUInterrupts::INT_NONE) {
-    return; // then nothing happens
   }
 
-  if (halted_) {
-    halted_ = false;
-  }
+  constexpr a16_t int_vecs[] = {0x40, 0x48, 0x50, 0x58, 0x60};
 
-  if (!_ime) {
-    debug_log(
-        "resume from the halt status by the interrupt :%d,enable:%x,flag:%x", i,
-        _interrupt_enable, _interrupt_flags);
-    // TODO:dmg bug, skip the next instruction.
-    return;
+  // the lowest bit has the highest priority
+  int i = CPUInterrupts::INT_V_BLANK;
+  while (!IS_BIT_SET(pending_, i)) {
+    ++i;
   }
-
   CLEAR_BIT(_interrupt_flags, i);
   _ime = false;
+  update_pending();
+  halted_ = false;
 
-  push(reg(CPURegister::REG_PC));
-  reg(CPURegister::REG_PC, int_vecs[i]);
+  push(reg<REG_PC>());
+  reg<REG_PC>(int_vecs[i]);
 
   if (i != CPUInterrupts::INT_V_BLANK)
     debug_log("now handle interrupt :%d,enable:%x,flag:%x", i,
               _interrupt_enable, _interrupt_flags);
-  return;
+}
+
+// the instruction after a bugged HALT, PC only moves past its tail
+int CPU::run_halt_bug() {
+  halted_ = false;
+  halt_bug_ = false;
+  auto pc = reg<REG_PC>();
+  DecodedInstruction inst;
+  InstructionTable::decode_halt_bug(this, pc, &inst);
+  reg<REG_PC>(pc - 1);
+  auto clocks = InstructionTable::execute(this, inst);
+  scheduler_->advance(clocks);
+  handle_interrupts();
+  return clocks;
 }
 
 std::string CPU::debug_info() const {
@@ -232,28 +248,192 @@ std::string CPU::debug_info() const {
   return std::string(buff);
 }
 
-int CPU::update() {
+void CPU::set_jit_mode(JitMode mode) {
+  if (mode == JitMode::JIT_OFF || !JitCompiler::supported()) {
+    jit_.reset();
+    return;
+  }
+  jit_.reset(new JitCompiler(this, mode));
+}
+
+// I/O ports (and IE) must see the timer and the GPU up to date, writes to the
+// cartridge may switch the ROM bank under the running code
+static inline bool is_sync_addr(a16_t addr, bool write) {
+  return (addr >= 0xFF00 && addr < 0xFF80) || addr == 0xFFFF ||
+         (write && addr < 0x8000);
+}
+
+bool CPU::deferrable(const DecodedInstruction &inst) const {
+  a16_t addr = 0;
+  switch (inst.flags & INST_MEM_MASK) {
+  case 0:
+    return true;
+  case INST_MEM_HL:
+    addr = reg<REG_HL>();
+    break;
+  case INST_MEM_BC:
+    addr = reg<REG_BC>();
+    break;
+  case INST_MEM_DE:
+    addr = reg<REG_DE>();
+    break;
+  case INST_MEM_A16:
+    addr = inst.operand;
+    break;
+  case INST_MEM_A8:
+    addr = 0xFF00 + (inst.operand & 0xff);
+    break;
+  case INST_MEM_C:
+    addr = 0xFF00 + reg<REG_C>();
+    break;
+  case INST_MEM_SP: {
+    // whatever is pushed or popped lies within SP-2 .. SP+1
+    a16_t sp = reg<REG_SP>();
+    return (sp >= 0x8002 && sp < 0xFEFF) || (sp >= 0xFF82 && sp < 0xFFFE);
+  }
+  }
+  bool write = inst.flags & INST_WRITE;
+  if (is_sync_addr(addr, write)) {
+    return false;
+  }
+  return !(inst.flags & INST_WIDE) || !is_sync_addr(addr + 1, write);
+}
+
+// returns false once the batch has to end, before inst if it touches
+// hardware which is not up to date yet
+bool CPU::step_batched(const DecodedInstruction &inst, int max_clocks,
+                       int *clocks) {
+  auto defer = deferrable(inst);
+  if (!defer && *clocks > 0) {
+    return false;
+  }
+  *clocks += InstructionTable::execute(this, inst);
+  return defer && *clocks < max_clocks && !halted_ && !interrupt_pending();
+}
+
+// same contract as step_batched for the whole block
+bool CPU::run_idle_loop(const BasicBlock &block, int max_clocks, int *clocks) {
+  materialize_flags();
+  auto start_registers = _registers;
+  auto start_clocks = *clocks;
+  for (const auto &inst : block.insts) {
+    if (*clocks == 0) {
+      // what the loop polls only changes on events, so unlike other I/O
+      // accesses the batch goes on after the read
+      *clocks += InstructionTable::execute(this, inst);
+      if (*clocks >= max_clocks || interrupt_pending()) {
+        return false;
+      }
+    } else if (!step_batched(inst, max_clocks, clocks)) {
+      return false;
+    }
+  }
+  materialize_flags();
+  if (memcmp(&start_registers, &_registers, sizeof(_registers)) != 0) {
+    return true;
+  }
+  // back at the head in the same state: every iteration reads the same
+  // values and repeats this one until the next event, run all those that end
+  // before it at once. The iteration the event lands in is left to the next
+  // batch, which stops at the instruction the event comes after
+  auto iteration = *clocks - start_clocks;
+  auto left = std::min(max_clocks, MAX_IDLE_CLOCKS) - *clocks;
+  if (left > 0) {
+    *clocks += left / iteration * iteration;
+  }
+  return false;
+}
+
+int CPU::update(int max_clocks) {
   if (halted_) {
-    timer_->update(this, 4);
+    if (halt_bug_) {
+      return run_halt_bug();
+    }
+    // nothing but a scheduled event can raise an interrupt while halted, so
+    // skip straight to it, staying on the 4 clocks grid of the instructions
+    auto clocks = std::min(scheduler_->clocks_to_next_event(), MAX_IDLE_CLOCKS);
+    clocks = std::min(clocks, max_clocks);
+    clocks = std::max(4, (clocks + 3) & ~3);
+    scheduler_->advance(clocks);
+    // only a key press ends the STOP mode, whether the joypad interrupt is
+    // enabled or not. Any requested interrupt ends HALT, with IME clear
+    // nothing else happens (the flag is not reset)
+    if (stopped_) {
+      if (!IS_BIT_SET(_interrupt_flags, CPUInterrupts::INT_JOYPAD)) {
+        return clocks;
+      }
+      stopped_ = false;
+      halted_ = false;
+    } else if (requested_interrupts() != 0) {
+      halted_ = false;
+    }
     handle_interrupts();
-    return 4;
+    return clocks;
   }
 
-  GB::InstructionDecoder decoder(this);
-  std::string dbg_info;
-  auto pc = reg(CPURegister::REG_PC);
   if (debug_mode_) {
-    dbg_info = debug_info();
-  }
-  auto instruction = decoder.decode();
-  if (debug_mode_) {
-    printf("[0x%04x] %-20s %s\n", pc, instruction->name().c_str(),
+    auto pc = reg<REG_PC>();
+    auto dbg_info = debug_info();
+    printf("[0x%04x] %-20s %s\n", pc,
+           GB::InstructionDecoder(this).disassemble().c_str(),
            dbg_info.c_str());
+    return step();
   }
-  auto cost_clocks = instruction->execute();
-  timer_->update(this, cost_clocks);
+
+  int cost_clocks = 0;
+  max_clocks = std::min(max_clocks, scheduler_->clocks_to_next_event());
+  auto running = true;
+  while (running) {
+    auto pc = reg<REG_PC>();
+    auto block = code_cache_->block(pc);
+    if (block == nullptr) {
+      DecodedInstruction inst = code_cache_->fetch(pc);
+      running = step_batched(inst, max_clocks, &cost_clocks);
+      continue;
+    }
+    if (block->idle_loop) {
+      running = run_idle_loop(*block, max_clocks, &cost_clocks);
+      continue;
+    }
+    if (jit_ && block->native == nullptr &&
+        ++block->exec_count == JIT_HOT_BLOCK_THRESHOLD) {
+      block->native = jit_->compile(block);
+    }
+    // an interrupt raised since the last batch stops it after one
+    // instruction, which only the interpreter loop can do
+    if (block->native != nullptr && !interrupt_pending()) {
+      running = block->native(this, max_clocks, &cost_clocks);
+      continue;
+    }
+    for (const auto &inst : block->insts) {
+      running = step_batched(inst, max_clocks, &cost_clocks);
+      if (!running) {
+        break;
+      }
+    }
+  }
+  scheduler_->advance(cost_clocks);
   handle_interrupts();
   return cost_clocks;
 }
 
+int CPU::step() {
+  if (halted_) {
+    return update();
+  }
+  auto clocks =
+      InstructionTable::execute(this, code_cache_->fetch(reg<REG_PC>()));
+  scheduler_->advance(clocks);
+  handle_interrupts();
+  return clocks;
+}
+
+int CPU::run_until(int clocks) {
+  int run = 0;
+  while (run < clocks) {
+    run += update(clocks - run);
+  }
+  return run;
+}
+
 } // namespace GB
\ No newline at end of file
@@ -3,11 +3,19 @@
 #include "common.h"
 #include "hardware.h"
 #include "memory.h"
+#include "scheduler.h"
 #include "timer.h"
+#include <climits>
 #include <memory>
 #include <string>
 
 namespace GB {
+class InstructionCache;
+class JitCompiler;
+struct DecodedInstruction;
+struct BasicBlock;
+enum JitMode : int;
+
 /*
 reg8_t:   r8	  (8bit register)
 reg16_t:  r16	  (16bit register)
@@ -39,6 +47,39 @@ enum CPURegister {
   REG_HL,
 };
 
+/*
+  The register file packs every 8-bit register into its 16-bit pair the way
+  the hardware does (AF, BC, DE, HL, then SP and PC), so that an 8-bit access
+  is a single byte load/store and a pair is a single 16-bit one.
+*/
+union RegisterFile {
+  reg16_t r16[6];
+  reg8_t r8[12];
+};
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr int REG_HIGH_BYTE = 0;
+#else
+constexpr int REG_HIGH_BYTE = 1;
+#endif
+
+constexpr bool is_reg8(CPURegister r) { return REG_A <= r && r <= REG_L; }
+
+// slot of an 8-bit register in RegisterFile::r8, A/B/D/H are the high halves
+constexpr int reg8_index(CPURegister r) {
+  return (r & ~1) + ((r & 1) == 0 ? REG_HIGH_BYTE : 1 - REG_HIGH_BYTE);
+}
+
+// slot of SP, PC or a register pair in RegisterFile::r16
+constexpr int reg16_index(CPURegister r) {
+  return r == REG_SP   ? 4
+         : r == REG_PC ? 5
+         : r == REG_AF ? 0
+         : r == REG_BC ? 1
+         : r == REG_DE ? 2
+                       : 3;
+}
+
 enum CPUFlagReg {
   FLAG_ZERO = 0x7,       // Z
   FLAG_SUB = 0x6,        // N
@@ -46,6 +87,16 @@ enum CPUFlagReg {
   FLAG_CARRY = 0x4,      // C
 };
 
+// the last flag-producing ALU operation, F is only computed when it is read
+enum LazyFlagsOp : uint8_t {
+  LAZY_FLAGS_NONE, // F is up to date
+  LAZY_FLAGS_ADD,  // ADD/ADC: dest + src + carry
+  LAZY_FLAGS_SUB,  // SUB/SBC/CP: dest - src - carry
+  LAZY_FLAGS_INC,  // INC r8 of dest, C is kept
+  LAZY_FLAGS_DEC,  // DEC r8 of dest, C is kept
+  LAZY_FLAGS_ZERO, // Z from dest (the result), N/H/C given by src
+};
+
 enum JumpCC {
   CC_NZ,
   CC_NC,
@@ -66,6 +117,7 @@ enum CPUInterrupts {
 constexpr int MAX_INTERRUPT_VALUE = (1 << INT_V_BLANK) | (1 << INT_LCD_STAT) |
                                     (1 << INT_TIMER) | (1 << INT_SERIAL) |
                                     (1 << INT_JOYPAD);
+constexpr uint8_t IF_UNUSED_BITS = 0xff & ~MAX_INTERRUPT_VALUE;
 
 struct CPURunStatus {
   bool disable_rom;
@@ -82,6 +134,29 @@ public:
   reg16_t reg(CPURegister r) const; // single register
   void reg(CPURegister r, reg16_t v);
 
+  // the same accessors resolved at compile time, the instruction handlers use
+  // these so that e.g. LD B,C is a single byte move
+  template <CPURegister R> reg16_t reg() const {
+    return R == REG_F    ? flags()
+           : R == REG_AF ? reg16_t(_registers.r8[reg8_index(REG_A)] << 8 |
+                                   flags())
+           : is_reg8(R)  ? _registers.r8[reg8_index(R)]
+                         : _registers.r16[reg16_index(R)];
+  }
+
+  template <CPURegister R> void reg(reg16_t v) {
+    if (R == REG_F || R == REG_AF) {
+      flags_op_ = LAZY_FLAGS_NONE;
+    }
+    if (R == REG_AF) {
+      _registers.r16[reg16_index(REG_AF)] = v & 0xFFF0;
+    } else if (is_reg8(R)) {
+      _registers.r8[reg8_index(R)] = v & 0xff;
+    } else {
+      _registers.r16[reg16_index(R)] = v;
+    }
+  }
+
   reg16_t incr(CPURegister r) {
     auto v = reg(r);
     reg(r, v + 1);
@@ -94,14 +169,38 @@ public:
     return v;
   }
 
-  bool test_flag(CPUFlagReg f) const { return _registers[REG_F] & (1U << f); }
+  template <CPURegister R> reg16_t incr() {
+    auto v = reg<R>();
+    reg<R>(v + 1);
+    return v;
+  }
+
+  template <CPURegister R> reg16_t decr() {
+    auto v = reg<R>();
+    reg<R>(v - 1);
+    return v;
+  }
+
+  bool test_flag(CPUFlagReg f) const { return flags() & (1U << f); }
 
   void set_flag(CPUFlagReg f, bool b) {
+    materialize_flags();
     if (b) {
-      _registers[REG_F] |= (1U << f);
+      flag_reg() |= (1U << f);
     } else {
-      _registers[REG_F] &= (~(1U << f));
+      flag_reg() &= (~(1U << f));
+    }
+  }
+
+  // records the operands of an ALU operation instead of setting its flags
+  void lazy_flags(LazyFlagsOp op, reg8_t dest, reg8_t src, reg8_t carry = 0) {
+    if (op == LAZY_FLAGS_INC || op == LAZY_FLAGS_DEC) {
+      materialize_flags();
     }
+    flags_op_ = op;
+    flags_dest_ = dest;
+    flags_src_ = src;
+    flags_carry_ = carry;
   }
 
   byte memory(size_t index) const;
@@ -111,15 +210,32 @@ public:
   reg16_t pop();
   void push(reg16_t v);
 
-  void disable_all_interrupt() { _ime = false; }
-  void enable_all_interrupt() { _ime = true; }
+  void disable_all_interrupt() {
+    _ime = false;
+    ei_delay_ = 0;
+    update_pending();
+  }
+  void enable_all_interrupt() {
+    _ime = true;
+    update_pending();
+  }
+  // EI only sets IME once the instruction after it has run
+  void ei() {
+    if (!_ime) {
+      ei_delay_ = 2;
+      update_pending();
+    }
+  }
 
   std::string debug_info() const;
 
   void set_ie(uint8_t data);
   void set_if(uint8_t data);
 
-  void request_interrupt(CPUInterrupts i) { SET_BIT(_interrupt_flags, i); }
+  void request_interrupt(CPUInterrupts i) {
+    SET_BIT(_interrupt_flags, i);
+    update_pending();
+  }
 
   uint8_t get_ie() const { return _interrupt_enable; }
   uint8_t get_if() const { return _interrupt_flags; }
@@ -131,28 +247,102 @@ public:
     return (_interrupt_enable & (1 << i)) != 0;
   }
 
-  void handle_interrupts();
+  // runs after every instruction batch, a single branch unless an interrupt
+  // is due or EI is in its delay
+  void handle_interrupts() {
+    if (pending_ != 0) {
+      service_interrupts();
+    }
+  }
+
+  // runs instructions up to the next scheduled event or until max_clocks have
+  // run (at least one instruction), fires the events that became due and
+  // services interrupts, returns the clocks run
+  int update(int max_clocks = INT_MAX);
+  // the same for exactly one instruction (a halted CPU sleeps until the next
+  // event instead)
+  int step();
+  // updates until at least clocks have run, returns the clocks run which only
+  // exceed clocks by what the last instruction (or HALT wait) ran over
+  int run_until(int clocks);
+  // with IME clear and an interrupt already requested the CPU does not halt,
+  // but reads the next opcode byte twice (the HALT bug)
+  void halt() {
+    halted_ = true;
+    halt_bug_ = !_ime && ei_delay_ == 0 && requested_interrupts() != 0;
+  }
+  // the CPU sleeps until a key is pressed
+  void stop() {
+    halted_ = true;
+    stopped_ = true;
+  }
 
-  int update();
-  void halt() { halted_ = true; }
+  Scheduler *scheduler() const { return scheduler_.get(); }
+
+  // hot ROM blocks are translated to native code when the host supports it
+  void set_jit_mode(JitMode mode);
 
   uint32_t frequency() const {
     return double_speed_mode_ ? 2 * clock_frequency_ : clock_frequency_;
   }
 
+private:
+  friend class JitCompiler;
+
+  reg8_t &flag_reg() { return _registers.r8[reg8_index(REG_F)]; }
+  reg8_t flag_reg() const { return _registers.r8[reg8_index(REG_F)]; }
+  reg8_t flags() const {
+    return flags_op_ == LAZY_FLAGS_NONE ? flag_reg() : compute_flags();
+  }
+  reg8_t compute_flags() const;
+  void materialize_flags() {
+    if (flags_op_ != LAZY_FLAGS_NONE) {
+      flag_reg() = compute_flags();
+      flags_op_ = LAZY_FLAGS_NONE;
+    }
+  }
+
+  uint8_t requested_interrupts() const {
+    return _interrupt_enable & _interrupt_flags & MAX_INTERRUPT_VALUE;
+  }
+  // pending_ is what handle_interrupts() has to look at: the requested
+  // interrupts while IME is set, and a bit above them while EI is delayed
+  void update_pending() {
+    pending_ = (_ime ? requested_interrupts() : 0) | (ei_delay_ ? 0x80 : 0);
+  }
+  bool interrupt_pending() const { return pending_ != 0; }
+  void service_interrupts();
+  int run_halt_bug();
+  bool deferrable(const DecodedInstruction &inst) const;
+  bool step_batched(const DecodedInstruction &inst, int max_clocks,
+                    int *clocks);
+  bool run_idle_loop(const BasicBlock &block, int max_clocks, int *clocks);
+
 private:
   bool debug_mode_;
-  reg16_t _registers[CPURegister::REG_MAX];
+  RegisterFile _registers;
+  LazyFlagsOp flags_op_;
+  reg8_t flags_dest_;
+  reg8_t flags_src_;
+  reg8_t flags_carry_;
   Memory *_memory;
 
+  UPtr<InstructionCache> code_cache_;
+  UPtr<JitCompiler> jit_;
+  UPtr<Scheduler> scheduler_;
+
   bool double_speed_mode_;
   uint32_t clock_frequency_;
 
   bool halted_;
+  bool halt_bug_;
+  bool stopped_;
   // Interrupt Implementations
   bool _ime; //  master enable flag
+  uint8_t ei_delay_; // handle_interrupts() calls left before EI sets IME
   uint8_t _interrupt_enable;
   uint8_t _interrupt_flags;
+  uint8_t pending_;
 
   // Timer Interrupt Implementation
   std::shared_ptr<Timer> timer_;
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "pixelmap.h"
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace GB {
+
+// rows start on this boundary, so whole rows can go through 32-byte vector
+// loads
+constexpr size_t FRAMEBUFFER_ALIGNMENT = 32;
+
+/*
+  Before C++17 new aligns no further than std::max_align_t, the classes that
+  hold a Framebuffer and are made with new derive from this for the rest.
+*/
+class framebuffer_owner {
+public:
+  static void *operator new(size_t size) {
+#ifdef _WIN32
+    void *p = _aligned_malloc(size, FRAMEBUFFER_ALIGNMENT);
+#else
+    void *p = nullptr;
+    if (posix_memalign(&p, FRAMEBUFFER_ALIGNMENT, size) != 0) {
+      p = nullptr;
+    }
+#endif
+    if (p == nullptr) {
+      throw std::bad_alloc();
+    }
+    return p;
+  }
+  static void operator delete(void *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+  }
+};
+
+/*
+  A picture of fixed size held in place: no heap, the stride is a constant
+  and copying one is a single memcpy. The frame path uses these; PixelMap is
+  left for the debug views of any size.
+*/
+template <size_t W, size_t H> class Framebuffer {
+public:
+  static constexpr size_t WIDTH = W;
+  static constexpr size_t HEIGHT = H;
+  static constexpr size_t STRIDE =
+      (W + FRAMEBUFFER_ALIGNMENT - 1) / FRAMEBUFFER_ALIGNMENT *
+      FRAMEBUFFER_ALIGNMENT;
+
+  Framebuffer() { clear(); }
+
+  constexpr size_t width() const { return W; }
+  constexpr size_t height() const { return H; }
+
+  pixel_t *row(size_t y) {
+    assert(y < H);
+    return &pixels_[y * STRIDE];
+  }
+  const pixel_t *row(size_t y) const {
+    assert(y < H);
+    return &pixels_[y * STRIDE];
+  }
+
+  void pixel(size_t x, size_t y, pixel_t p) {
+    assert(x < W);
+    row(y)[x] = p;
+  }
+  pixel_t pixel(size_t x, size_t y) const {
+    assert(x < W);
+    return row(y)[x];
+  }
+
+  void clear() { memset(pixels_, 0, sizeof(pixels_)); }
+
+private:
+  alignas(FRAMEBUFFER_ALIGNMENT) pixel_t pixels_[STRIDE * H];
+};
+
+template <size_t W, size_t H> constexpr size_t Framebuffer<W, H>::WIDTH;
+template <size_t W, size_t H> constexpr size_t Framebuffer<W, H>::HEIGHT;
+template <size_t W, size_t H> constexpr size_t Framebuffer<W, H>::STRIDE;
+
+} // namespace GB
@@ -2,75 +2,72 @@
 #include "common.h"
 #include "cpu.h"
 #include "memory.h"
+#include "pixel_ops.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <iterator>
 
 namespace GB {
-TileSelector::TileSelector(const byte *ram, bool td) : ram_(ram) {
-  if (td) {
-    tile_data_start_addr_ = 0x8000;
-    tile_num_offset_ = 0;
-  } else {
-    tile_data_start_addr_ = 0x8800;
-    tile_num_offset_ = 128;
-  }
-}
-
-Tile TileSelector::get_tile(a16_t addr) const {
-  assert(addr >= VideoMemoryRange::TileDataStart &&
-         addr < VideoMemoryRange::TileDataEnd && (addr & 0xF) == 0);
-  addr -= 0x8000;
-
-  const byte *bmp = &ram_[addr];
-  Tile t;
-
-  auto i = 0;
-  while (i < BYTE_NUM_PER_TILE) {
-    auto fb = bmp[i];
-    auto sb = bmp[i + 1];
-
-    for (auto j = 0; j < PIXEL_NUM_PER_TILE; ++j) {
-      auto p = ((sb & 1) << 1) | (fb & 1);
-      t.pixel(PIXEL_NUM_PER_TILE - 1 - j, i / 2, p);
-      fb >>= 1;
-      sb >>= 1;
+namespace {
+constexpr int LCD_MODE_CLOCKS[] = {204, 456, 80, 172};
+constexpr int LCD_FRAME_CLOCKS = 70224;
+// in GPU::line_changes_, a line not drawn since the LCD came on
+constexpr uint64_t NO_LINE = ~uint64_t(0);
+
+// moves the LCD timeline past the end of the current mode
+void step_mode(LCDMode *mode, uint8_t *lines, uint64_t *start) {
+  switch (*mode) {
+  case LCDMode::Mode0:
+    if (*lines >= 144) {
+      // the first V-Blank line keeps counting from the H-Blank before it
+      *mode = LCDMode::Mode1;
+      return;
     }
-    i += 2;
+    *start += LCD_MODE_CLOCKS[LCDMode::Mode0];
+    ++*lines;
+    *mode = LCDMode::Mode2;
+    return;
+  case LCDMode::Mode2:
+    *start += LCD_MODE_CLOCKS[LCDMode::Mode2];
+    *mode = LCDMode::Mode3;
+    return;
+  case LCDMode::Mode3:
+    *start += LCD_MODE_CLOCKS[LCDMode::Mode3];
+    *mode = LCDMode::Mode0;
+    return;
+  case LCDMode::Mode1:
+    *start += LCD_MODE_CLOCKS[LCDMode::Mode1];
+    if (++*lines >= 154) {
+      *mode = LCDMode::Mode2;
+      *lines = 0;
+    }
+    return;
   }
-  return t;
 }
+} // namespace
 
-Sprite::Sprite(size_t width, size_t height, d8_t x, d8_t y, d8_t tile_num,
-               d8_t flags, const TileSelector &selector)
-    : PixelMap(width, height), x_(x), y_(y), flags_(flags) {
-  if (height == PIXEL_NUM_PER_TILE) {
-    auto t = selector.select(tile_num);
-    merge_from(t, 0, 0);
-  } else if (height == PIXEL_NUM_PER_TILE * 2) {
-    auto upper_tile = selector.select(tile_num & 0xFE);
-    auto lower_tile = selector.select(tile_num | 0x01);
-    merge_from(upper_tile, 0, 0);
-    merge_from(lower_tile, 0, PIXEL_NUM_PER_TILE);
-  } else {
-    assert(0);
-  }
-
-  if (flags_ & (1 << 6)) {
-    vflip();
-  }
-
-  if (flags_ & (1 << 5)) {
-    hflip();
-  }
+TileCache::TileCache(const PixelOps &ops) : ops_(ops) {
+  memset(rows_, 0, sizeof(rows_));
+}
 
-  // TODO: priority check
+void TileCache::update(const byte *ram, size_t offset) {
+  auto tile = offset / BYTE_NUM_PER_TILE;
+  auto y = offset % BYTE_NUM_PER_TILE / 2;
+  // the two bitplanes of the row
+  auto lo = ram[offset & ~size_t(1)];
+  auto hi = ram[offset | 1];
+  ops_.decode_row(lo, hi, rows_[0][tile][y], rows_[1][tile][y]);
 }
 
-OAM::OAM() { memset(ram_, 0, sizeof(ram_)); }
+OAM::OAM() : changes_(0) { memset(ram_, 0, sizeof(ram_)); }
 
 void OAM::set(a16_t addr, byte data) {
   assert(addr >= 0xFE00 && addr <= 0xFE9F);
-  ram_[addr - 0xFE00] = data;
+  if (ram_[addr - 0xFE00] != data) {
+    ram_[addr - 0xFE00] = data;
+    ++changes_;
+  }
 }
 
 byte OAM::get(a16_t addr) const {
@@ -78,59 +75,60 @@ byte OAM::get(a16_t addr) const {
   return ram_[addr - 0xFE00];
 }
 
-std::vector<Sprite> OAM::collect_sprites(const TileSelector &selector,
-                                         uint8_t lcd_ctrl) const {
-  size_t width = PIXEL_NUM_PER_TILE;
-  size_t height = PIXEL_NUM_PER_TILE;
-
-  if (IS_BIT_SET(lcd_ctrl, LCDCtrlBits::GCF_SPRITE_SIZE)) {
-    height *= 2;
-  }
-
-  std::vector<Sprite> list;
-  for (a16_t start = 0; start < OAM_RAM_LENGTH; start += 4) {
-    auto y = ram_[start];
-    auto x = ram_[start + 1];
-    auto tile_num = ram_[start + 2];
-    auto flags = ram_[start + 3];
-
-    if (y < 16 || y >= 160 || x < 8 || x >= 168) {
-      continue;
-    }
-
-    list.push_back(
-        Sprite(width, height, x - 8, y - 16, tile_num, flags, selector));
-  }
-  return list;
-}
-
 GPU::GPU(CPU *cpu)
-    : cpu_(cpu), oam_(new OAM()), lcd_ctrl_(0), lcd_status_(0), scy_(0),
-      scx_(0), lyc_(0), bgp_(0), bgp0_(0), bgp1_(0), wy_(0), wx_(0),
-      mode_(LCDMode::Mode2), curr_mode_clocks_(0), curr_lines_(0) {
+    : cpu_(cpu), scheduler_(cpu->scheduler()), oam_(new OAM()),
+      pixel_ops_(&pixel_ops()), tiles_(*pixel_ops_), lcd_ctrl_(0),
+      lcd_status_(0), stat_(0), stat_line_(false), scy_(0), scx_(0), lyc_(0),
+      bgp_(0), bgp0_(0), bgp1_(0), wy_(0), wx_(0), mode_(LCDMode::Mode0),
+      mode_start_(cpu->scheduler()->now()), curr_lines_(0), window_line_(0),
+      line_sprite_num_(0), changes_(0), frame_ready_(false), frame_skip_(0),
+      skipped_frames_(0), draw_frame_(true), frame_drawn_(true),
+      redrawn_(false), frame_changed_(true) {
   memset(ram_, 0, sizeof(ram_));
+  std::fill(std::begin(line_changes_), std::end(line_changes_), NO_LINE);
+  scheduler_->connect(SchedulerEvent::EVENT_PPU_MODE, this);
+  update_stat();
+  schedule_mode(); // the LCD is off until LCDC says otherwise
 }
 GPU::~GPU() {}
 
 void GPU::connect(Memory *memory) {
-  memory->map_port(MappedIOPorts::REG_LCD_CTRL, this);
-  memory->map_port(MappedIOPorts::REG_LCD_STATUS, this);
-  memory->map_port(MappedIOPorts::REG_SCY, this);
-  memory->map_port(MappedIOPorts::REG_SCX, this);
-  memory->map_port(MappedIOPorts::REG_LY, this);
-  memory->map_port(MappedIOPorts::REG_LYC, this);
-  memory->map_port(MappedIOPorts::REG_BGP, this);
-  memory->map_port(MappedIOPorts::REG_BGP0, this);
-  memory->map_port(MappedIOPorts::REG_BGP1, this);
-  memory->map_port(MappedIOPorts::REG_WY, this);
-  memory->map_port(MappedIOPorts::REG_WX, this);
+  memory->map_port<GPU, &GPU::set_lcd_ctrl>(MappedIOPorts::REG_LCD_CTRL, this,
+                                            &lcd_ctrl_);
+  memory->map_port<GPU, &GPU::set_lcd_status>(MappedIOPorts::REG_LCD_STATUS,
+                                              this, &stat_);
+  memory->map_port<GPU, &GPU::set_draw_reg<&GPU::scy_>>(
+      MappedIOPorts::REG_SCY, this, &scy_);
+  memory->map_port<GPU, &GPU::set_draw_reg<&GPU::scx_>>(
+      MappedIOPorts::REG_SCX, this, &scx_);
+  memory->map_port<GPU, &GPU::set_ly>(MappedIOPorts::REG_LY, this,
+                                      &curr_lines_);
+  memory->map_port<GPU, &GPU::set_lyc>(MappedIOPorts::REG_LYC, this, &lyc_);
+  memory->map_port<GPU, &GPU::set_draw_reg<&GPU::bgp_>>(
+      MappedIOPorts::REG_BGP, this, &bgp_);
+  memory->map_port<GPU, &GPU::set_draw_reg<&GPU::bgp0_>>(
+      MappedIOPorts::REG_BGP0, this, &bgp0_);
+  memory->map_port<GPU, &GPU::set_draw_reg<&GPU::bgp1_>>(
+      MappedIOPorts::REG_BGP1, this, &bgp1_);
+  memory->map_port<GPU, &GPU::set_draw_reg<&GPU::wy_>>(MappedIOPorts::REG_WY,
+                                                        this, &wy_);
+  memory->map_port<GPU, &GPU::set_draw_reg<&GPU::wx_>>(MappedIOPorts::REG_WX,
+                                                        this, &wx_);
   memory->connect_gpu(this);
   memory->connect_oam(oam_.get());
 }
 
 void GPU::set(a16_t addr, byte data) {
   assert(addr >= 0x8000 && addr <= 0x9fff);
-  ram_[addr - 0x8000] = data;
+  auto offset = addr - 0x8000;
+  if (ram_[offset] == data) {
+    return;
+  }
+  ram_[offset] = data;
+  ++changes_;
+  if (addr < TileDataEnd) {
+    tiles_.update(ram_, offset);
+  }
 }
 
 byte GPU::get(a16_t addr) const {
@@ -143,211 +141,276 @@ const byte *GPU::addr(a16_t addr) const {
   return &ram_[addr - 0x8000];
 }
 
-void GPU::set_reg(a16_t addr, byte data) {
-  switch (addr) {
-  case MappedIOPorts::REG_LCD_CTRL:
-    lcd_ctrl_ = data;
-    return;
-  case MappedIOPorts::REG_LCD_STATUS:
-    lcd_status_ = data;
-    return;
-  case MappedIOPorts::REG_SCY:
-    scy_ = data;
-    return;
-  case MappedIOPorts::REG_SCX:
-    scx_ = data;
-    return;
-  case MappedIOPorts::REG_LY:
-    curr_lines_ = data;
-    check_lyc();
-    return;
-  case MappedIOPorts::REG_LYC:
-    lyc_ = data;
-    check_lyc();
-    return;
-  case MappedIOPorts::REG_BGP:
-    bgp_ = data;
-    return;
-  case MappedIOPorts::REG_BGP0:
-    bgp0_ = data;
-    return;
-  case MappedIOPorts::REG_BGP1:
-    bgp1_ = data;
-    return;
-  case MappedIOPorts::REG_WY:
-    wy_ = data;
-    return;
-  case MappedIOPorts::REG_WX:
-    wx_ = data;
-    return;
-  default:
-    assert(0);
-  }
+void GPU::set_lcd_status(byte data) {
+  lcd_status_ = data;
+  update_stat();
 }
 
-byte GPU::get_reg(a16_t addr) const {
-  switch (addr) {
-  case MappedIOPorts::REG_LCD_CTRL:
-    return lcd_ctrl_;
-  case MappedIOPorts::REG_LCD_STATUS:
-    return lcd_status_;
-  case MappedIOPorts::REG_SCY:
-    return scy_;
-  case MappedIOPorts::REG_SCX:
-    return scx_;
-  case MappedIOPorts::REG_LY:
-    return curr_lines_;
-  case MappedIOPorts::REG_LYC:
-    return lyc_;
-  case MappedIOPorts::REG_BGP:
-    return bgp_;
-  case MappedIOPorts::REG_BGP0:
-    return bgp0_;
-  case MappedIOPorts::REG_BGP1:
-    return bgp1_;
-  case MappedIOPorts::REG_WY:
-    return wy_;
-  case MappedIOPorts::REG_WX:
-    return wx_;
-  default:
-    assert(0);
-  }
+void GPU::set_ly(byte data) {
+  curr_lines_ = data;
+  ++changes_;
+  update_stat();
 }
 
-PixelMap GPU::get_tile_map(a16_t base_addr) const {
-  constexpr auto bgwin_size = TILE_NUM_PER_BGWIN_SIDE * PIXEL_NUM_PER_TILE;
-  PixelMap pm(bgwin_size, bgwin_size);
+void GPU::set_lyc(byte data) {
+  lyc_ = data;
+  update_stat();
+}
 
-  TileSelector selector(
-      ram_, IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_BG_WINDOW_TILE_DATA));
+void GPU::update_stat() {
+  auto coincidence = lyc_ == curr_lines_;
+  stat_ = (lcd_status_ & ~0x7) | (coincidence ? 1 << GSF_COINCIDENCE : 0) |
+          static_cast<uint8_t>(mode_);
+  // the interrupt comes as the line goes high, a source coming on while
+  // another holds it high goes unnoticed
+  auto line =
+      lcd_on() &&
+      ((coincidence &&
+        IS_BIT_SET(lcd_status_, LCDStatusBits::GSF_COINCIDENCE_INTERRUPT)) ||
+       (mode_ == LCDMode::Mode0 &&
+        IS_BIT_SET(lcd_status_, LCDStatusBits::GSF_HBLANK_INTERRUPT)) ||
+       (mode_ == LCDMode::Mode1 &&
+        IS_BIT_SET(lcd_status_, LCDStatusBits::GSF_VBLANK_INTERRUPT)) ||
+       (mode_ == LCDMode::Mode2 &&
+        IS_BIT_SET(lcd_status_, LCDStatusBits::GSF_OAM_INTERRUPT)));
+  if (line && !stat_line_) {
+    cpu_->request_interrupt(CPUInterrupts::INT_LCD_STAT);
+  }
+  stat_line_ = line;
+}
 
+void GPU::get_tile_map(a16_t base_addr, TileMapFrame *map) const {
   const byte *tile_nums = addr(base_addr);
-  for (auto i = 0; i < TILE_NUM_PER_BGWIN_SIDE * TILE_NUM_PER_BGWIN_SIDE; ++i) {
-    auto y = i / TILE_NUM_PER_BGWIN_SIDE * PIXEL_NUM_PER_TILE;
-    auto x = i % TILE_NUM_PER_BGWIN_SIDE * PIXEL_NUM_PER_TILE;
-    pm.merge_from(selector.select(tile_nums[i]), x, y);
+  for (auto y = 0; y < PIXEL_NUM_OF_BGWIN_SIDE; ++y) {
+    for (auto x = 0; x < PIXEL_NUM_OF_BGWIN_SIDE; x += PIXEL_NUM_PER_TILE) {
+      auto num = tile_nums[y / PIXEL_NUM_PER_TILE * TILE_NUM_PER_BGWIN_SIDE +
+                           x / PIXEL_NUM_PER_TILE];
+      memcpy(map->row(y) + x,
+             tiles_.row(bg_tile(num), y % PIXEL_NUM_PER_TILE),
+             PIXEL_NUM_PER_TILE);
+    }
   }
-
-  return pm;
 }
 
 constexpr static a16_t TileMapBaseAddr[] = {VideoMemoryRange::BGWin0MapAddr,
                                             VideoMemoryRange::BGWin1MapAddr};
 
-PixelMap GPU::get_current_background() const {
-  PixelMap view(SCREEN_WIDTH_TILE_NUM * PIXEL_NUM_PER_TILE,
-                SCREEN_HEIGTH_TILE_NUM * PIXEL_NUM_PER_TILE);
-  auto bg_map_base_addr =
-      TileMapBaseAddr[(lcd_ctrl_ >> LCDCtrlBits::GCF_BG_TILE_MAP_DATA) & 0x1];
-  auto full_bg = get_tile_map(bg_map_base_addr);
-  auto screen_bg = full_bg.cut(scx_, scy_, view.width(), view.height());
-  view.merge_from(screen_bg, 0, 0);
-  // wrap the upper side
-  if (screen_bg.height() < view.height()) {
-    view.merge_from(full_bg, scx_, screen_bg.height());
+void GPU::render_line() {
+  auto ly = curr_lines_;
+  auto window =
+      IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_BG_DISPLAY_ENABLED) &&
+      IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_WINDOW_DISPLAY_ENABLED) &&
+      wy_ <= ly && wx_ <= 166;
+  // with nothing changed since the line was drawn, the lines before it were
+  // drawn the same way too and the window has got as far
+  auto changes = state_changes();
+  if (line_changes_[ly] != changes) {
+    draw_line(window);
+    line_changes_[ly] = changes;
+    redrawn_ = true;
   }
-  // wrap the right side
-  if (screen_bg.width() < view.width()) {
-    view.merge_from(full_bg, screen_bg.width(), scy_);
+  if (window) {
+    ++window_line_;
   }
-  // TODO left,right,upper,lower side must be handled
-
-  return view;
 }
 
-PixelMap GPU::get_view() const {
-  PixelMap view(SCREEN_WIDTH_TILE_NUM * PIXEL_NUM_PER_TILE,
-                SCREEN_HEIGTH_TILE_NUM * PIXEL_NUM_PER_TILE);
+void GPU::draw_line(bool window) {
+  auto ly = curr_lines_;
+  auto line = frame_.row(ly);
+  // colour numbers first, then the whole line through BGP; with BG off, BG
+  // and window are blank and sprites show over all of it
+  pixel_t colors[SCREEN_WIDTH];
+  if (!IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_BG_DISPLAY_ENABLED)) {
+    memset(colors, 0, SCREEN_WIDTH);
+    memset(line, 0, SCREEN_WIDTH);
+  } else {
+    auto bg_map =
+        TileMapBaseAddr[(lcd_ctrl_ >> LCDCtrlBits::GCF_BG_TILE_MAP_DATA) & 0x1];
+    render_tiles(colors, 0, bg_map, scx_, uint8_t(scy_ + ly));
+
+    if (window) {
+      auto win_map = TileMapBaseAddr[(lcd_ctrl_ >>
+                                      LCDCtrlBits::GCF_WINDOW_TILE_MAP) &
+                                     0x1];
+      // WX is the window's left edge plus 7
+      if (wx_ >= 7) {
+        render_tiles(colors, wx_ - 7, win_map, 0, window_line_);
+      } else {
+        render_tiles(colors, 0, win_map, 7 - wx_, window_line_);
+      }
+    }
+    pixel_ops_->map_palette(colors, line, SCREEN_WIDTH, bgp_);
+  }
 
-  if (IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_BG_DISPLAY_ENABLED)) {
-    view.merge_from(get_current_background(), 0, 0);
+  if (IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_SPRITE_DISPLAY_ENABLED)) {
+    render_sprites(colors, line);
   }
+}
 
-  if (IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_WINDOW_DISPLAY_ENABLED)) {
-    assert(wy_ < 144 && wx_ >= 7 && wx_ <= 166);
-    auto win_map_base_addr =
-        TileMapBaseAddr[(lcd_ctrl_ >> LCDCtrlBits::GCF_WINDOW_TILE_MAP) & 0x1];
-    auto full_win = get_tile_map(win_map_base_addr);
-    auto screen_win = full_win.cut(wx_ - 7, wy_, view.width(), view.height());
-    view.merge_from(screen_win, 0, 0);
+void GPU::render_tiles(pixel_t *colors, int x, a16_t map_addr, uint8_t map_x,
+                       uint8_t map_y) const {
+  const byte *tile_nums =
+      addr(map_addr + map_y / PIXEL_NUM_PER_TILE * TILE_NUM_PER_BGWIN_SIDE);
+  auto y = map_y % PIXEL_NUM_PER_TILE;
+  while (x < SCREEN_WIDTH) {
+    auto pixels =
+        tiles_.row(bg_tile(tile_nums[map_x / PIXEL_NUM_PER_TILE]), y);
+    auto px = map_x % PIXEL_NUM_PER_TILE;
+    auto n = std::min(PIXEL_NUM_PER_TILE - px, SCREEN_WIDTH - x);
+    memcpy(colors + x, pixels + px, n);
+    x += n;
+    map_x += n;
   }
+}
 
-  // collect pixels of sprits
-  if (IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_SPRITE_DISPLAY_ENABLED)) {
-    auto sprite_list =
-        oam_->collect_sprites(TileSelector(ram_, true), lcd_ctrl_);
-    for (const auto &sprite : sprite_list) {
-      view.merge_from(sprite, sprite.x(), sprite.y());
+int GPU::sprite_height() const {
+  return IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_SPRITE_SIZE)
+             ? PIXEL_NUM_PER_TILE * 2
+             : PIXEL_NUM_PER_TILE;
+}
+
+void GPU::scan_oam() {
+  auto height = sprite_height();
+  auto sprites = oam_->data();
+  line_sprite_num_ = 0;
+  // the first ten in OAM on the line count, wherever their X puts them
+  for (int i = 0;
+       i < OAM_SPRITE_NUM && line_sprite_num_ < SPRITE_NUM_PER_LINE; ++i) {
+    auto sprite = &sprites[i * OAM_SPRITE_SIZE];
+    int row = curr_lines_ - (sprite[0] - 16);
+    if (row < 0 || row >= height) {
+      continue;
+    }
+    // the smaller X is drawn over the larger, OAM order breaks ties; insert
+    // after every sprite with an X no larger
+    auto at = line_sprite_num_++;
+    for (; at > 0 && line_sprites_[at - 1][1] > sprite[1]; --at) {
+      memcpy(line_sprites_[at], line_sprites_[at - 1], OAM_SPRITE_SIZE);
     }
+    memcpy(line_sprites_[at], sprite, OAM_SPRITE_SIZE);
   }
+}
 
-  return view;
+void GPU::render_sprites(const pixel_t *bg, pixel_t *line) const {
+  auto height = sprite_height();
+  // whether a pixel has been claimed by a sprite of higher priority, even one
+  // hidden behind the BG
+  bool taken[SCREEN_WIDTH] = {};
+  for (int i = 0; i < line_sprite_num_; ++i) {
+    auto sprite = line_sprites_[i];
+    int row = curr_lines_ - (sprite[0] - 16);
+    auto flags = sprite[3];
+    if (IS_BIT_SET(flags, 6)) {
+      row = height - 1 - row;
+    }
+    auto num = height > PIXEL_NUM_PER_TILE ? sprite[2] & 0xfe : sprite[2];
+    // an 8x16 sprite runs on into the next tile
+    auto pixels = tiles_.row(num + row / PIXEL_NUM_PER_TILE,
+                             row % PIXEL_NUM_PER_TILE, IS_BIT_SET(flags, 5));
+    auto palette = IS_BIT_SET(flags, 4) ? bgp1_ : bgp0_;
+    auto behind_bg = IS_BIT_SET(flags, 7);
+    int left = sprite[1] - 8;
+    for (int px = 0; px < PIXEL_NUM_PER_TILE; ++px) {
+      auto x = left + px;
+      // color 0 is transparent
+      if (x < 0 || x >= SCREEN_WIDTH || taken[x] || pixels[px] == 0) {
+        continue;
+      }
+      taken[x] = true;
+      // behind the BG, only BG colour 0 lets the sprite through
+      if (!behind_bg || bg[x] == 0) {
+        line[x] = (palette >> (pixels[px] * 2)) & 0x3;
+      }
+    }
+  }
 }
 
 PixelMap GPU::get_all_tiles() const {
-  TileSelector selector(
-      ram_, IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_BG_WINDOW_TILE_DATA));
-
+  // 16 tiles a row
   PixelMap pm(128, 192);
-  int num = 0;
-  for (int i = VideoMemoryRange::TileDataStart;
-       i < VideoMemoryRange::TileDataEnd; i += BYTE_NUM_PER_TILE, ++num) {
-    pm.merge_from(selector.get_tile(i), (num & 0xF) << 3, (num >> 4) << 3);
+  for (int tile = 0; tile < TILE_NUM; ++tile) {
+    auto x = (tile & 0xF) * PIXEL_NUM_PER_TILE;
+    for (auto y = 0; y < PIXEL_NUM_PER_TILE; ++y) {
+      memcpy(pm.row((tile >> 4) * PIXEL_NUM_PER_TILE + y) + x,
+             tiles_.row(tile, y), PIXEL_NUM_PER_TILE);
+    }
   }
   return pm;
 }
 
-void GPU::check_lyc() {
-  if (lyc_ != curr_lines_) {
-    CLEAR_BIT(lcd_status_, 2);
+void GPU::set_lcd_ctrl(byte data) {
+  auto was_on = lcd_on();
+  if (lcd_ctrl_ != data) {
+    lcd_ctrl_ = data;
+    ++changes_;
+  }
+  if (was_on == lcd_on()) {
     return;
   }
-  SET_BIT(lcd_status_, 2);
+  // switching the LCD restarts its timeline from line 0, the screen goes
+  // blank while it is off
+  curr_lines_ = 0;
+  start_frame();
+  if (!lcd_on()) {
+    frame_.clear();
+    std::fill(std::begin(line_changes_), std::end(line_changes_), NO_LINE);
+    redrawn_ = true;
+  }
+  mode_ = lcd_on() ? LCDMode::Mode2 : LCDMode::Mode0;
+  mode_start_ = scheduler_->now();
+  update_stat();
+  schedule_mode();
+}
 
-  if (IS_BIT_SET(lcd_status_, 6)) {
-    cpu_->request_interrupt(CPUInterrupts::INT_LCD_STAT);
+void GPU::schedule_mode() {
+  auto length = lcd_on() ? LCD_MODE_CLOCKS[mode_] : LCD_FRAME_CLOCKS;
+  scheduler_->schedule(SchedulerEvent::EVENT_PPU_MODE, mode_start_ + length);
+}
+
+void GPU::start_frame() {
+  window_line_ = 0;
+  redrawn_ = false;
+  draw_frame_ = frame_skip_ != FRAME_SKIP_ALL && skipped_frames_ >= frame_skip_;
+  skipped_frames_ = draw_frame_ ? 0 : skipped_frames_ + 1;
+}
+
+void GPU::next_mode() {
+  auto visible = curr_lines_ < SCREEN_HEIGHT;
+  if (mode_ == LCDMode::Mode2 && visible && draw_frame_) {
+    scan_oam();
+  } else if (mode_ == LCDMode::Mode3 && visible && draw_frame_) {
+    render_line();
+  } else if (mode_ == LCDMode::Mode0 && curr_lines_ >= 144) {
+    frame_ready_ = true;
+    frame_drawn_ = draw_frame_;
+    frame_changed_ = redrawn_;
+    cpu_->request_interrupt(CPUInterrupts::INT_V_BLANK);
   }
+  step_mode(&mode_, &curr_lines_, &mode_start_);
+  if (mode_ == LCDMode::Mode2 && curr_lines_ == 0) {
+    start_frame();
+  }
+  update_stat();
+  schedule_mode();
 }
 
-bool GPU::update(int clocks) {
-  auto refresh = false;
-  curr_mode_clocks_ += clocks;
-  if (mode_ == LCDMode::Mode0) {
-    if (curr_mode_clocks_ >= 204) {
-      if (curr_lines_ >= 144) {
-        mode_ = LCDMode::Mode1;
-        refresh = true;
-      } else {
-        ++curr_lines_;
-        mode_ = LCDMode::Mode2;
-        curr_mode_clocks_ -= 204;
-        check_lyc();
-      }
-    }
-  } else if (mode_ == LCDMode::Mode2) {
-    if (curr_mode_clocks_ >= 80) {
-      mode_ = LCDMode::Mode3;
-      curr_mode_clocks_ -= 80;
-    }
-  } else if (mode_ == LCDMode::Mode3) {
-    if (curr_mode_clocks_ >= 172) {
-      mode_ = LCDMode::Mode0;
-      curr_mode_clocks_ -= 172;
-    }
-  } else if (mode_ == LCDMode::Mode1) {
-    if (curr_mode_clocks_ >= 456) {
-      curr_mode_clocks_ -= 456;
-      if (++curr_lines_ >= 154) {
-        mode_ = LCDMode::Mode2;
-        curr_lines_ = 0;
-      }
-      check_lyc();
+void GPU::on_event(SchedulerEvent event, uint64_t when) {
+  switch (event) {
+  case SchedulerEvent::EVENT_PPU_MODE:
+    if (!lcd_on()) {
+      mode_start_ += LCD_FRAME_CLOCKS;
+      frame_ready_ = true;
+      frame_drawn_ = draw_frame_;
+      frame_changed_ = redrawn_;
+      start_frame();
+      schedule_mode();
+      return;
     }
+    next_mode();
+    return;
+  default:
+    assert(0);
   }
-
-  lcd_status_ = (lcd_status_ & (~0x3)) | static_cast<uint8_t>(mode_);
-
-  return refresh;
 }
 
 } // namespace GB
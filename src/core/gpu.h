@@ -1,10 +1,11 @@
 #pragma once
 
+#include "framebuffer.h"
 #include "hardware.h"
 #include "memory_operator.h"
 #include "pixelmap.h"
+#include "scheduler.h"
 #include <memory>
-#include <vector>
 
 namespace GB {
 
@@ -46,6 +47,22 @@ enum LCDCtrlBits {
   GCF_WINDOW_TILE_MAP = 6,
   GCF_LCD_DISPLAY_ENABLED = 7,
 };
+
+/*
+  Bit 6 - LYC=LY Coincidence Interrupt (1=Enable) (Read/Write)
+  Bit 5 - Mode 2 OAM Interrupt         (1=Enable) (Read/Write)
+  Bit 4 - Mode 1 V-Blank Interrupt     (1=Enable) (Read/Write)
+  Bit 3 - Mode 0 H-Blank Interrupt     (1=Enable) (Read/Write)
+  Bit 2 - Coincidence Flag  (0:LYC<>LY, 1:LYC=LY) (Read Only)
+  Bit 1-0 - Mode Flag       (Mode 0-3)            (Read Only)
+*/
+enum LCDStatusBits {
+  GSF_COINCIDENCE = 2,
+  GSF_HBLANK_INTERRUPT = 3,
+  GSF_VBLANK_INTERRUPT = 4,
+  GSF_OAM_INTERRUPT = 5,
+  GSF_COINCIDENCE_INTERRUPT = 6,
+};
 constexpr size_t GPU_VIDEO_MEMORY_SIZE = 0x2000;
 
 constexpr int PIXEL_NUM_PER_TILE = 8;
@@ -56,49 +73,45 @@ constexpr int PIXEL_NUM_OF_BGWIN_SIDE =
 
 constexpr int SCREEN_WIDTH_TILE_NUM = 20;
 constexpr int SCREEN_HEIGTH_TILE_NUM = 18;
+constexpr int SCREEN_WIDTH = SCREEN_WIDTH_TILE_NUM * PIXEL_NUM_PER_TILE;
+constexpr int SCREEN_HEIGHT = SCREEN_HEIGTH_TILE_NUM * PIXEL_NUM_PER_TILE;
 
-class Tile : public PixelMap {
-public:
-  Tile() : PixelMap(PIXEL_NUM_PER_TILE, PIXEL_NUM_PER_TILE) {}
-};
+constexpr int TILE_NUM = (TileDataEnd - TileDataStart) / BYTE_NUM_PER_TILE;
 
-class TileSelector final {
-private:
-  a16_t tile_addr(a16_t base_addr, uint8_t num) const {
-    return base_addr + num * BYTE_NUM_PER_TILE;
-  }
+// shades 0-3 as the LCD shows them
+typedef Framebuffer<SCREEN_WIDTH, SCREEN_HEIGHT> ScreenFrame;
+// colour numbers of a whole BG/window tile map
+typedef Framebuffer<PIXEL_NUM_OF_BGWIN_SIDE, PIXEL_NUM_OF_BGWIN_SIDE>
+    TileMapFrame;
 
-public:
-  TileSelector(const byte *ram, bool td);
-  Tile get_tile(a16_t addr) const;
-  Tile select(uint8_t num) const {
-    return get_tile(
-        tile_addr(tile_data_start_addr_, uint8_t(num + tile_num_offset_)));
-  }
-
-private:
-  const byte *ram_;
-  a16_t tile_data_start_addr_;
-  uint8_t tile_num_offset_;
-};
+struct PixelOps;
 
-class Sprite : public PixelMap {
+/*
+  Every tile in VRAM decoded to a colour number per pixel, as it is and
+  flipped horizontally. A write to tile data decodes the row it lands in again.
+*/
+class TileCache final : public non_copyable {
 public:
-  Sprite(size_t width, size_t height, d8_t x, d8_t y, d8_t tile_num, d8_t flags,
-         const TileSelector &selector);
+  explicit TileCache(const PixelOps &ops);
 
-  d8_t x() const { return x_; }
-  d8_t y() const { return y_; }
-
-  void draw() const;
+  // offset is into VRAM, below the tile maps
+  void update(const byte *ram, size_t offset);
+  const pixel_t *row(int tile, int y, bool hflip = false) const {
+    return rows_[hflip][tile][y];
+  }
 
 private:
-  d8_t x_; // 0 - 160
-  d8_t y_; // 0 - 144
-  d8_t flags_;
+  const PixelOps &ops_;
+  pixel_t rows_[2][TILE_NUM][PIXEL_NUM_PER_TILE][PIXEL_NUM_PER_TILE];
 };
 
+// for GPU::set_frame_skip(), no frame is drawn at all
+constexpr int FRAME_SKIP_ALL = -1;
+
 constexpr size_t OAM_RAM_LENGTH = 0xa0;
+constexpr int OAM_SPRITE_NUM = 40;
+constexpr int OAM_SPRITE_SIZE = 4;
+constexpr int SPRITE_NUM_PER_LINE = 10;
 class OAM final : public MemoryOperator, public non_copyable {
 public:
   OAM();
@@ -106,17 +119,39 @@ public:
   void set(a16_t addr, byte data) override;
   byte get(a16_t addr) const override;
 
-  std::vector<Sprite> collect_sprites(const TileSelector &selector,
-                                      uint8_t lcd_ctrl) const;
+  // OAM_SPRITE_SIZE bytes a sprite: y + 16, x + 8, tile number and flags
+  const byte *data() const { return ram_; }
+  // counts the writes that changed a byte
+  uint64_t changes() const { return changes_; }
 
 private:
   byte ram_[OAM_RAM_LENGTH];
+  uint64_t changes_;
 };
 
 class Memory;
 class CPU;
+
+/*
+  The LCD timeline runs on a scheduler event at the end of every mode, LY only
+  changes there too, so STAT and its interrupt are worked out then and when
+  STAT, LY, LYC or LCDC are written. While the LCD is off a frame tick keeps
+  the frame pace going.
+
+  Every line is drawn into the frame as its Mode 3 ends, with the registers as
+  they are at that point, so changes made between lines show up. The sprites
+  of a line are picked from OAM as its Mode 2 ends.
+
+  Frames can be skipped: their timeline, LY, STAT and interrupts run as ever
+  but nothing is drawn, the frame keeps the last one drawn.
+
+  A line is only drawn again if anything it is drawn from (VRAM, OAM, LCDC,
+  LY and the scroll, window and palette registers) has changed since it was
+  last drawn, so still screens cost next to nothing.
+*/
 class GPU final : public MemoryOperator,
-                  public IPortOperator,
+                  public IEventHandler,
+                  public framebuffer_owner,
                   public non_copyable {
 public:
   GPU(CPU *cpu);
@@ -126,30 +161,93 @@ public:
 
   void set(a16_t addr, byte data) override;
   byte get(a16_t addr) const override;
-
-  void set_reg(a16_t addr, byte data) override;
-  byte get_reg(a16_t addr) const override;
-
-  bool update(int clocks);
-
-  PixelMap get_tile_map(a16_t base_addr) const;
-  PixelMap get_current_background() const;
-  PixelMap get_view() const;
+  const byte *read_page(a16_t addr) const override {
+    return this->addr(addr);
+  }
+  // all of VRAM is written through set, to keep the tile cache current and
+  // count the changes lines are drawn from
+  byte *write_page(a16_t addr) override { return nullptr; }
+
+  void on_event(SchedulerEvent event, uint64_t when) override;
+  // true once for every completed frame, drawn or skipped
+  bool take_frame() {
+    auto ready = frame_ready_;
+    frame_ready_ = false;
+    return ready;
+  }
+  // whether the last completed frame was drawn
+  bool frame_drawn() const { return frame_drawn_; }
+  // whether the last completed frame differs from the one drawn before it
+  bool frame_changed() const { return frame_changed_; }
+  // draws one frame, then skips the next frames ones, or skips every frame
+  // with FRAME_SKIP_ALL; takes effect from the next frame on
+  void set_frame_skip(int frames) { frame_skip_ = frames; }
+
+  // shades 0-3 of the last completed frame, lines of the next one replace
+  // it from the end of V-Blank
+  const ScreenFrame &frame() const { return frame_; }
+
+  void get_tile_map(a16_t base_addr, TileMapFrame *map) const;
   PixelMap get_all_tiles() const;
 
-  void check_lyc() ;
-
 private:
   const byte *addr(a16_t addr) const;
+  bool lcd_on() const {
+    return IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_LCD_DISPLAY_ENABLED);
+  }
+  void set_lcd_ctrl(byte data);
+  void set_lcd_status(byte data);
+  void set_ly(byte data);
+  void set_lyc(byte data);
+  // a register read only for drawing
+  template <uint8_t GPU::*Reg> void set_draw_reg(byte data) {
+    if (this->*Reg != data) {
+      this->*Reg = data;
+      ++changes_;
+    }
+  }
+  // changes to VRAM, OAM and the registers lines are drawn with, so far
+  uint64_t state_changes() const { return changes_ + oam_->changes(); }
+  // STAT as read and the STAT interrupt line, refreshed whenever the mode,
+  // LY, LYC, STAT or the LCD power change
+  void update_stat();
+  void next_mode();
+  // at line 0, decides whether the frame is drawn
+  void start_frame();
+  // draws the current line unless it is in the frame already
+  void render_line();
+  void draw_line(bool window);
+  // colour numbers of a map from (map_x, map_y) on, from colors[x] to the end
+  void render_tiles(pixel_t *colors, int x, a16_t map_addr, uint8_t map_x,
+                    uint8_t map_y) const;
+  // 8 or 16, as LCDC bit 2 says
+  int sprite_height() const;
+  // up to SPRITE_NUM_PER_LINE sprites on the current line, in drawing priority
+  void scan_oam();
+  // bg holds the BG and window colour numbers, for sprites behind them
+  void render_sprites(const pixel_t *bg, pixel_t *line) const;
+  // the tile a BG or window tile number stands for, as LCDC bit 4 says
+  int bg_tile(uint8_t num) const {
+    if (IS_BIT_SET(lcd_ctrl_, LCDCtrlBits::GCF_BG_WINDOW_TILE_DATA)) {
+      return num;
+    }
+    return 256 + int8_t(num);
+  }
+  void schedule_mode();
 
 private:
   CPU *cpu_;
+  Scheduler *scheduler_;
   std::shared_ptr<OAM> oam_;
+  const PixelOps *pixel_ops_;
   /* data */
   byte ram_[GPU_VIDEO_MEMORY_SIZE];
+  TileCache tiles_;
 
   uint8_t lcd_ctrl_;
   uint8_t lcd_status_;
+  uint8_t stat_;
+  bool stat_line_; // the enabled STAT sources ORed together
   uint8_t scy_;
   uint8_t scx_;
   uint8_t lyc_;
@@ -160,8 +258,23 @@ private:
   uint8_t wx_;
 
   LCDMode mode_;
-  int curr_mode_clocks_;
-  int curr_lines_;
+  uint64_t mode_start_; // the clock the current mode is counted from
+  uint8_t curr_lines_;
+  uint8_t window_line_; // the line of the window drawn next
+  // copies of the OAM entries scan_oam() picked
+  byte line_sprites_[SPRITE_NUM_PER_LINE][OAM_SPRITE_SIZE];
+  int line_sprite_num_;
+  uint64_t changes_;
+  // state_changes() as each line of the frame was drawn, NO_LINE if not
+  uint64_t line_changes_[SCREEN_HEIGHT];
+  bool frame_ready_;
+  int frame_skip_;
+  int skipped_frames_; // in a row, since the last frame drawn
+  bool draw_frame_;    // whether the frame running is drawn
+  bool frame_drawn_;   // draw_frame_ of the last completed frame
+  bool redrawn_;       // whether any line of the frame running has changed
+  bool frame_changed_; // redrawn_ of the last completed frame
+  ScreenFrame frame_;
 };
 
 } // namespace GB
@@ -84,7 +84,7 @@ class EI_Inst : public Instruction {
 public:
   EI_Inst(CPU *cpu) : Instruction(cpu) {}
   int internal_exec() override {
-    _cpu->enable_all_interrupt();
+    _cpu->ei();
     return 4;
   }
   std::string name() override { return std::string("EI"); }
@@ -110,7 +110,10 @@ public:
 class Stop_Inst : public Instruction {
 public:
   Stop_Inst(CPU *cpu) : Instruction(cpu) {}
-  int internal_exec() override { return 4; }
+  int internal_exec() override {
+    _cpu->stop();
+    return 4;
+  }
   std::string name() override { return std::string("STOP"); }
 };
 
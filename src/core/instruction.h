@@ -8,6 +8,8 @@
 #define HALF_CARRY_SUB_TEST(a, b) ((((a)&0xf) < ((b)&0xf)))
 
 namespace GB {
+// The CPU executes through InstructionTable, the Instruction objects are only
+// decoded to disassemble the code for debug output.
 class Instruction {
 public:
   Instruction(CPU *cpu) : _cpu(cpu) {}
@@ -0,0 +1,236 @@
+#include "instruction_cache.h"
+#include "cpu.h"
+#include "memory.h"
+#include <algorithm>
+#include <cstring>
+
+namespace GB {
+constexpr size_t WRAM_SIZE = 0x2000;
+constexpr size_t HRAM_SIZE = 0x7F;
+constexpr size_t BOOT_ROM_SIZE = 0x100;
+constexpr size_t MAX_BLOCK_LENGTH = 64;
+
+static DecodedInstruction *new_entries(size_t n) {
+  auto entries = new DecodedInstruction[n];
+  memset(entries, 0, n * sizeof(DecodedInstruction));
+  return entries;
+}
+
+// the target of a JR/JP ending the block at addr, -1 for anything else
+static int jump_target(const DecodedInstruction &inst, a16_t addr) {
+  switch (inst.opcode) {
+  case 0x18:
+  case 0x20:
+  case 0x28:
+  case 0x30:
+  case 0x38:
+    return a16_t(addr + inst.length + int8_t(inst.operand & 0xff));
+  case 0xC2:
+  case 0xC3:
+  case 0xCA:
+  case 0xD2:
+  case 0xDA:
+    return inst.operand;
+  default:
+    return -1;
+  }
+}
+
+// what a polling loop may read: LY/STAT only change on the LCD events, RAM
+// and ROM only under the CPU itself (the cartridge RAM area may hold a clock)
+static bool idle_readable(a16_t addr) {
+  return addr == 0xFF41 || addr == 0xFF44 || addr < 0x8000 ||
+         (addr >= 0xC000 && addr < 0xFE00) || (addr >= 0xFF80 && addr < 0xFFFF);
+}
+
+// only the first instruction may sync with the hardware, so that a whole
+// iteration runs within a batch
+static bool is_idle_loop(const BasicBlock &block) {
+  a16_t addr = block.addr;
+  for (size_t i = 0; i < block.insts.size(); ++i) {
+    const auto &inst = block.insts[i];
+    if (inst.cycles == 0 || inst.opcode == 0xF3 || inst.opcode == 0xFB) {
+      return false; // unknown, DI, EI
+    }
+    if (inst.flags & INST_ENDS_BLOCK) {
+      return i + 1 == block.insts.size() &&
+             jump_target(inst, addr) == block.addr;
+    }
+    switch (inst.flags & (INST_MEM_MASK | INST_WRITE)) {
+    case 0:
+      break;
+    case INST_MEM_A8:
+    case INST_MEM_A16: {
+      a16_t mem = (inst.flags & INST_MEM_MASK) == INST_MEM_A8
+                      ? 0xFF00 + (inst.operand & 0xff)
+                      : inst.operand;
+      if (!idle_readable(mem) || (inst.flags & INST_WIDE) ||
+          (i > 0 && mem >= 0xFF00)) {
+        return false;
+      }
+      break;
+    }
+    default:
+      return false;
+    }
+    addr += inst.length;
+  }
+  return false;
+}
+
+InstructionCache::InstructionCache(CPU *cpu, Memory *memory)
+    : cpu_(cpu), memory_(memory), wram_(new_entries(WRAM_SIZE)),
+      hram_(new_entries(HRAM_SIZE)) {
+  memset(wram_entries_, 0, sizeof(wram_entries_));
+}
+
+InstructionCache::~InstructionCache() {}
+
+bool InstructionCache::rom_key(a16_t pc, size_t *bank, size_t *offset,
+                               a16_t *limit) const {
+  if (pc < 0x100 && memory_->boot_rom_loaded()) {
+    return false;
+  } else if (pc < 0x4000) {
+    *bank = 0;
+    *offset = pc;
+    *limit = 0x4000;
+    return true;
+  } else if (pc < 0x8000) {
+    *bank = memory_->rom_bank();
+    *offset = pc - 0x4000;
+    *limit = 0x8000;
+    return true;
+  }
+  return false;
+}
+
+DecodedInstruction *InstructionCache::lookup(a16_t pc, a16_t *limit) {
+  size_t bank = 0;
+  size_t offset = 0;
+  if (rom_key(pc, &bank, &offset, limit)) {
+    if (bank >= rom_banks_.size()) {
+      rom_banks_.resize(bank + 1);
+    }
+    if (!rom_banks_[bank]) {
+      rom_banks_[bank].reset(new_entries(ROM_BANK_SIZE));
+    }
+    return &rom_banks_[bank][offset];
+  } else if (pc >= 0xC000 && pc < 0xE000) {
+    *limit = 0xE000;
+    return &wram_[pc - 0xC000];
+  } else if (pc >= 0xE000 && pc < 0xFE00) {
+    *limit = 0xFE00;
+    return &wram_[pc - 0xE000];
+  } else if (pc >= 0xFF80 && pc < 0xFFFF) {
+    *limit = 0xFFFF;
+    return &hram_[pc - 0xFF80];
+  }
+  return nullptr;
+}
+
+const DecodedInstruction &InstructionCache::fetch(a16_t pc) {
+  a16_t limit = 0;
+  auto inst = lookup(pc, &limit);
+  if (inst != nullptr && inst->handler == nullptr) {
+    InstructionTable::decode(cpu_, pc, inst);
+    if (pc >= 0xC000 && pc < 0xFE00) {
+      watch_wram(inst - wram_.get(), 1);
+    }
+  }
+  // the instruction runs over the end of the region, its tail bytes can
+  // change without the entry knowing
+  if (inst == nullptr || size_t(pc) + inst->length > limit) {
+    InstructionTable::decode(cpu_, pc, &scratch_);
+    return scratch_;
+  }
+  return *inst;
+}
+
+void InstructionCache::invalidate(a16_t addr) {
+  DecodedInstruction *entries = nullptr;
+  size_t offset = 0;
+  if (addr >= 0xC000 && addr < 0xE000) {
+    entries = wram_.get();
+    offset = addr - 0xC000;
+  } else if (addr >= 0xFF80 && addr < 0xFFFF) {
+    entries = hram_.get();
+    offset = addr - 0xFF80;
+  } else {
+    return;
+  }
+  // the written byte can be the opcode or an operand of an instruction
+  // starting up to 2 bytes before
+  for (size_t i = 0; i < 3 && i <= offset; ++i) {
+    auto &entry = entries[offset - i];
+    if (entry.handler != nullptr && entries == wram_.get()) {
+      watch_wram(offset - i, -1);
+    }
+    entry.handler = nullptr;
+  }
+}
+
+void InstructionCache::watch_wram(size_t offset, int delta) {
+  auto last = std::min(offset + wram_[offset].length - 1, WRAM_SIZE - 1);
+  // an instruction can run on into the next page
+  for (auto page = offset >> 8; page <= last >> 8; ++page) {
+    auto &count = wram_entries_[page];
+    if (delta > 0 && count++ == 0) {
+      memory_->watch_writes(0xC0 + page);
+    } else if (delta < 0 && --count == 0) {
+      memory_->unwatch_writes(0xC0 + page);
+    }
+  }
+}
+
+BasicBlock *InstructionCache::block(a16_t pc) {
+  size_t bank = 0;
+  size_t offset = 0;
+  a16_t limit = 0;
+  UPtr<BasicBlock> *blocks = nullptr;
+  if (pc < BOOT_ROM_SIZE && memory_->boot_rom_loaded()) {
+    if (!boot_blocks_) {
+      boot_blocks_.reset(new UPtr<BasicBlock>[BOOT_ROM_SIZE]);
+    }
+    blocks = boot_blocks_.get();
+    offset = pc;
+    limit = BOOT_ROM_SIZE;
+  } else if (rom_key(pc, &bank, &offset, &limit)) {
+    if (bank >= rom_blocks_.size()) {
+      rom_blocks_.resize(bank + 1);
+    }
+    if (!rom_blocks_[bank]) {
+      rom_blocks_[bank].reset(new UPtr<BasicBlock>[ROM_BANK_SIZE]);
+    }
+    blocks = rom_blocks_[bank].get();
+  } else {
+    return nullptr;
+  }
+  auto &block = blocks[offset];
+  if (!block) {
+    block.reset(build_block(pc, limit));
+  }
+  return block->insts.empty() ? nullptr : block.get();
+}
+
+BasicBlock *InstructionCache::build_block(a16_t pc, a16_t limit) {
+  auto block = new BasicBlock();
+  block->addr = pc;
+  block->exec_count = 0;
+  block->native = nullptr;
+  while (block->insts.size() < MAX_BLOCK_LENGTH) {
+    DecodedInstruction inst;
+    InstructionTable::decode(cpu_, pc, &inst);
+    if (size_t(pc) + inst.length > limit) {
+      break;
+    }
+    block->insts.push_back(inst);
+    if (inst.flags & INST_ENDS_BLOCK) {
+      break;
+    }
+    pc += inst.length;
+  }
+  block->idle_loop = is_idle_loop(*block);
+  return block;
+}
+
+} // namespace GB
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "common.h"
+#include "hardware.h"
+#include "instruction_table.h"
+#include <memory>
+#include <vector>
+
+namespace GB {
+class CPU;
+class Memory;
+
+constexpr size_t WRAM_PAGE_NUM = 0x20;
+
+// native code of a basic block, same contract as CPU::step_batched for the
+// whole block
+typedef bool (*CompiledBlock)(CPU *cpu, int max_clocks, int *clocks);
+
+// a straight run of ROM code, only its last instruction may jump
+struct BasicBlock {
+  a16_t addr;
+  std::vector<DecodedInstruction> insts;
+  uint32_t exec_count;
+  CompiledBlock native;
+  // the block jumps back to itself and only reads memory which nothing but
+  // a scheduled event can change (LY, STAT, RAM, ROM)
+  bool idle_loop;
+};
+
+/*
+  Predecoded instructions keyed by where their bytes live.
+
+  ROM code is keyed by (ROM bank, offset in bank), so it is decoded once for
+  the whole run whatever bank switching happens. Code running from WRAM (and
+  its echo) or HRAM is cached as well; Memory::set calls invalidate() for
+  every write there, which drops each entry that may cover the written byte.
+  Only the WRAM pages holding cached code have their writes watched, a page
+  goes back to plain stores once its last entry is dropped.
+  Everything else (boot ROM, VRAM, cartridge RAM, ...) is decoded on the fly.
+
+  ROM code (and the boot ROM while it is mapped) is also grouped into basic
+  blocks which never need invalidation.
+*/
+class InstructionCache final : public non_copyable {
+public:
+  InstructionCache(CPU *cpu, Memory *memory);
+  ~InstructionCache();
+
+  const DecodedInstruction &fetch(a16_t pc);
+  void invalidate(a16_t addr);
+
+  // the basic block starting at pc, nullptr if pc is not in ROM or boot ROM
+  BasicBlock *block(a16_t pc);
+
+private:
+  DecodedInstruction *lookup(a16_t pc, a16_t *limit);
+  bool rom_key(a16_t pc, size_t *bank, size_t *offset, a16_t *limit) const;
+  BasicBlock *build_block(a16_t pc, a16_t limit);
+  // counts the WRAM entry at offset on the pages it spans
+  void watch_wram(size_t offset, int delta);
+
+private:
+  CPU *cpu_;
+  Memory *memory_;
+  std::vector<UPtr<DecodedInstruction[]>> rom_banks_;
+  std::vector<UPtr<UPtr<BasicBlock>[]>> rom_blocks_;
+  UPtr<UPtr<BasicBlock>[]> boot_blocks_;
+  UPtr<DecodedInstruction[]> wram_;
+  // cached WRAM entries on each page
+  uint16_t wram_entries_[WRAM_PAGE_NUM];
+  UPtr<DecodedInstruction[]> hram_;
+  DecodedInstruction scratch_;
+};
+
+} // namespace GB
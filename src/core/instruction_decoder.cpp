@@ -26,8 +26,7 @@ static inline uint8_t decode_read8(InstructionReader *reader) {
   return (uint8_t)reader->readByte();
 }
 
-InstructionPtr InstructionDecoder::decodeOneCB(InstructionReader *reader) throw(
-    decode_exception) {
+InstructionPtr InstructionDecoder::decodeOneCB(InstructionReader *reader) {
   if (!reader->remain(1)) {
     return InstructionPtr();
   }
@@ -583,8 +582,7 @@ InstructionPtr InstructionDecoder::decodeOneCB(InstructionReader *reader) throw(
   throw decode_exception("unknown cb instruction ");
 }
 
-InstructionPtr InstructionDecoder::decodeOne(InstructionReader *reader) throw(
-    decode_exception) {
+InstructionPtr InstructionDecoder::decodeOne(InstructionReader *reader) {
   if (!reader->remain(1)) {
     return InstructionPtr();
   }
@@ -1193,8 +1191,20 @@ InstructionPtr InstructionDecoder::decodeOne(InstructionReader *reader) throw(
   throw decode_exception("unknown instruction ");
 }
 
-InstructionPtr InstructionDecoder::decode() throw(decode_exception) {
+InstructionPtr InstructionDecoder::decode() {
   InstructionReader reader(_cpu);
   return decodeOne(&reader);
 }
+
+std::string InstructionDecoder::disassemble() {
+  auto pc = _cpu->reg(CPURegister::REG_PC);
+  std::string name;
+  try {
+    name = decode()->name();
+  } catch (const decode_exception &e) {
+    name = "???";
+  }
+  _cpu->reg(CPURegister::REG_PC, pc);
+  return name;
+}
 } // namespace GB
\ No newline at end of file
@@ -38,11 +38,13 @@ class InstructionDecoder final {
 public:
   InstructionDecoder(CPU *cpu) : _cpu(cpu) {}
 
-  InstructionPtr decode() throw(decode_exception);
+  InstructionPtr decode();
+  // decode the instruction at PC for debug output, PC is left untouched
+  std::string disassemble();
 
 protected:
-  InstructionPtr decodeOneCB(InstructionReader *reader) throw(decode_exception);
-  InstructionPtr decodeOne(InstructionReader *reader) throw(decode_exception);
+  InstructionPtr decodeOneCB(InstructionReader *reader);
+  InstructionPtr decodeOne(InstructionReader *reader);
 
 private:
   CPU *_cpu;
@@ -0,0 +1,769 @@
+#include "instruction_table.h"
+#include "instruction_decoder.h"
+
+namespace GB {
+
+namespace {
+// operand order of the opcode matrix: B,C,D,E,H,L,[HL],A
+constexpr CPURegister R8_OPERANDS[] = {
+    CPURegister::REG_B, CPURegister::REG_C,   CPURegister::REG_D,
+    CPURegister::REG_E, CPURegister::REG_H,   CPURegister::REG_L,
+    CPURegister::REG_MAX /*[HL]*/,            CPURegister::REG_A};
+
+template <int IDX> struct R8Operand {
+  static reg8_t get(CPU *cpu) { return cpu->reg<R8_OPERANDS[IDX]>(); }
+  static void set(CPU *cpu, reg8_t v) { cpu->reg<R8_OPERANDS[IDX]>(v); }
+};
+
+template <> struct R8Operand<6> {
+  static reg8_t get(CPU *cpu) {
+    return cpu->memory(cpu->reg<CPURegister::REG_HL>());
+  }
+  static void set(CPU *cpu, reg8_t v) {
+    cpu->memory(cpu->reg<CPURegister::REG_HL>(), v);
+  }
+};
+
+inline bool test_condition(CPU *cpu, JumpCC cc) {
+  switch (cc) {
+  case JumpCC::CC_NZ:
+    return !cpu->test_flag(CPUFlagReg::FLAG_ZERO);
+  case JumpCC::CC_NC:
+    return !cpu->test_flag(CPUFlagReg::FLAG_CARRY);
+  case JumpCC::CC_Z:
+    return cpu->test_flag(CPUFlagReg::FLAG_ZERO);
+  case JumpCC::CC_C:
+    return cpu->test_flag(CPUFlagReg::FLAG_CARRY);
+  }
+  return false;
+}
+
+//=================================INC/DEC=========================
+template <int IDX> int inc_r8(CPU *cpu, d16_t) {
+  reg8_t dest = R8Operand<IDX>::get(cpu);
+  reg8_t result = dest + 1;
+  R8Operand<IDX>::set(cpu, result);
+  cpu->lazy_flags(LAZY_FLAGS_INC, dest, 1);
+  return IDX == 6 ? 12 : 4;
+}
+
+template <int IDX> int dec_r8(CPU *cpu, d16_t) {
+  reg8_t dest = R8Operand<IDX>::get(cpu);
+  reg8_t result = dest - 1;
+  R8Operand<IDX>::set(cpu, result);
+  cpu->lazy_flags(LAZY_FLAGS_DEC, dest, 1);
+  return IDX == 6 ? 12 : 4;
+}
+
+template <CPURegister R> int inc_r16(CPU *cpu, d16_t) {
+  cpu->incr<R>();
+  return 8;
+}
+
+template <CPURegister R> int dec_r16(CPU *cpu, d16_t) {
+  cpu->decr<R>();
+  return 8;
+}
+
+//=================================8bit ALU=========================
+enum ALUOperation {
+  ALU_ADD,
+  ALU_ADC,
+  ALU_SUB,
+  ALU_SBC,
+  ALU_AND,
+  ALU_XOR,
+  ALU_OR,
+  ALU_CP,
+};
+
+// the flags are left to CPU::lazy_flags, ADC/SBC read the previous carry
+inline void alu_exec(CPU *cpu, ALUOperation op, reg8_t src) {
+  reg8_t dest = cpu->reg<CPURegister::REG_A>();
+  switch (op) {
+  case ALU_ADD:
+    cpu->reg<CPURegister::REG_A>(reg8_t(dest + src));
+    cpu->lazy_flags(LAZY_FLAGS_ADD, dest, src);
+    break;
+  case ALU_ADC: {
+    reg8_t carry = cpu->test_flag(CPUFlagReg::FLAG_CARRY);
+    cpu->reg<CPURegister::REG_A>(reg8_t(dest + src + carry));
+    cpu->lazy_flags(LAZY_FLAGS_ADD, dest, src, carry);
+    break;
+  }
+  case ALU_SUB:
+    cpu->reg<CPURegister::REG_A>(reg8_t(dest - src));
+    cpu->lazy_flags(LAZY_FLAGS_SUB, dest, src);
+    break;
+  case ALU_SBC: {
+    reg8_t carry = cpu->test_flag(CPUFlagReg::FLAG_CARRY);
+    cpu->reg<CPURegister::REG_A>(reg8_t(dest - src - carry));
+    cpu->lazy_flags(LAZY_FLAGS_SUB, dest, src, carry);
+    break;
+  }
+  case ALU_AND: {
+    reg8_t result = dest & src;
+    cpu->reg<CPURegister::REG_A>(result);
+    cpu->lazy_flags(LAZY_FLAGS_ZERO, result, 1 << CPUFlagReg::FLAG_HALF_CARRY);
+    break;
+  }
+  case ALU_XOR:
+  case ALU_OR: {
+    reg8_t result = op == ALU_XOR ? dest ^ src : dest | src;
+    cpu->reg<CPURegister::REG_A>(result);
+    cpu->lazy_flags(LAZY_FLAGS_ZERO, result, 0);
+    break;
+  }
+  case ALU_CP:
+    cpu->lazy_flags(LAZY_FLAGS_SUB, dest, src);
+    break;
+  }
+}
+
+template <ALUOperation OP, int IDX> int alu_r8(CPU *cpu, d16_t) {
+  alu_exec(cpu, OP, R8Operand<IDX>::get(cpu));
+  return IDX == 6 ? 8 : 4;
+}
+
+template <ALUOperation OP> int alu_d8(CPU *cpu, d16_t operand) {
+  alu_exec(cpu, OP, static_cast<d8_t>(operand));
+  return 8;
+}
+
+//=================================16bit ALU=========================
+template <CPURegister R> int add_hl_r16(CPU *cpu, d16_t) {
+  reg16_t dest = cpu->reg<CPURegister::REG_HL>();
+  reg16_t src = cpu->reg<R>();
+  uint32_t result = dest + src;
+  cpu->reg<CPURegister::REG_HL>((reg16_t)result);
+
+  cpu->set_flag(CPUFlagReg::FLAG_SUB, false);
+  cpu->set_flag(CPUFlagReg::FLAG_HALF_CARRY,
+                ((dest & 0xfff) + (src & 0xfff)) & 0x1000);
+  cpu->set_flag(CPUFlagReg::FLAG_CARRY, result & 0x10000);
+  return 8;
+}
+
+int add_sp_r8(CPU *cpu, d16_t operand) {
+  r8_t param = static_cast<r8_t>(operand);
+  reg16_t v = cpu->reg<CPURegister::REG_SP>();
+  reg16_t n = v + param;
+  cpu->reg<CPURegister::REG_SP>(n);
+
+  cpu->set_flag(CPUFlagReg::FLAG_ZERO, false);
+  cpu->set_flag(CPUFlagReg::FLAG_SUB, false);
+  cpu->set_flag(CPUFlagReg::FLAG_HALF_CARRY, (v ^ param ^ n) & 0x10);
+  cpu->set_flag(CPUFlagReg::FLAG_CARRY, (v ^ param ^ n) & 0x100);
+  return 16;
+}
+
+int ldhl_sp_r8(CPU *cpu, d16_t operand) {
+  r8_t param = static_cast<r8_t>(operand);
+  a16_t addr = cpu->reg<CPURegister::REG_SP>();
+  a16_t result = addr + param;
+  cpu->reg<CPURegister::REG_HL>(result);
+
+  cpu->set_flag(CPUFlagReg::FLAG_ZERO, false);
+  cpu->set_flag(CPUFlagReg::FLAG_SUB, false);
+  cpu->set_flag(CPUFlagReg::FLAG_HALF_CARRY, (addr ^ param ^ result) & 0x10);
+  cpu->set_flag(CPUFlagReg::FLAG_CARRY, (addr ^ param ^ result) & 0x100);
+  return 12;
+}
+
+//=================================LD=========================
+template <int DEST, int SRC> int ld_r8_r8(CPU *cpu, d16_t) {
+  R8Operand<DEST>::set(cpu, R8Operand<SRC>::get(cpu));
+  return (DEST == 6 || SRC == 6) ? 8 : 4;
+}
+
+template <int DEST> int ld_r8_d8(CPU *cpu, d16_t operand) {
+  R8Operand<DEST>::set(cpu, static_cast<d8_t>(operand));
+  return DEST == 6 ? 12 : 8;
+}
+
+template <CPURegister R> int ld_r16_d16(CPU *cpu, d16_t operand) {
+  cpu->reg<R>(operand);
+  return 12;
+}
+
+template <CPURegister R> int ld_r16p_a(CPU *cpu, d16_t) {
+  cpu->memory(cpu->reg<R>(), cpu->reg<CPURegister::REG_A>());
+  return 8;
+}
+
+template <CPURegister R> int ld_a_r16p(CPU *cpu, d16_t) {
+  a16_t addr = cpu->reg<R>();
+  cpu->reg<CPURegister::REG_A>(cpu->memory(addr));
+  return 8;
+}
+
+int ld_a16_a(CPU *cpu, d16_t operand) {
+  cpu->memory(operand, cpu->reg<CPURegister::REG_A>());
+  return 16;
+}
+
+int ld_a_a16(CPU *cpu, d16_t operand) {
+  cpu->reg<CPURegister::REG_A>(cpu->memory(operand));
+  return 16;
+}
+
+int ldh_a8_a(CPU *cpu, d16_t operand) {
+  cpu->memory(0xFF00 + static_cast<a8_t>(operand),
+              static_cast<byte>(cpu->reg<CPURegister::REG_A>()));
+  return 12;
+}
+
+int ldh_a_a8(CPU *cpu, d16_t operand) {
+  cpu->reg<CPURegister::REG_A>(
+      cpu->memory(0xFF00 + static_cast<a8_t>(operand)));
+  return 12;
+}
+
+int ld_cp_a(CPU *cpu, d16_t) {
+  cpu->memory(0xFF00 + cpu->reg<CPURegister::REG_C>(),
+              cpu->reg<CPURegister::REG_A>());
+  return 8;
+}
+
+int ld_a_cp(CPU *cpu, d16_t) {
+  cpu->reg<CPURegister::REG_A>(
+      cpu->memory(0xFF00 + cpu->reg<CPURegister::REG_C>()));
+  return 8;
+}
+
+int ldi_hlp_a(CPU *cpu, d16_t) {
+  a16_t addr = cpu->incr<CPURegister::REG_HL>();
+  cpu->memory(addr, cpu->reg<CPURegister::REG_A>());
+  return 8;
+}
+
+int ldd_hlp_a(CPU *cpu, d16_t) {
+  a16_t addr = cpu->decr<CPURegister::REG_HL>();
+  cpu->memory(addr, cpu->reg<CPURegister::REG_A>());
+  return 8;
+}
+
+int ldi_a_hlp(CPU *cpu, d16_t) {
+  a16_t addr = cpu->incr<CPURegister::REG_HL>();
+  cpu->reg<CPURegister::REG_A>(cpu->memory(addr));
+  return 8;
+}
+
+int ldd_a_hlp(CPU *cpu, d16_t) {
+  a16_t addr = cpu->decr<CPURegister::REG_HL>();
+  cpu->reg<CPURegister::REG_A>(cpu->memory(addr));
+  return 8;
+}
+
+int ld_a16p_sp(CPU *cpu, d16_t operand) {
+  reg16_t data = cpu->reg<CPURegister::REG_SP>();
+  cpu->memory(operand, byte(data & 0xff));
+  cpu->memory(operand + 1, byte(data >> 8));
+  return 20;
+}
+
+int ld_sp_hl(CPU *cpu, d16_t) {
+  cpu->reg<CPURegister::REG_SP>(cpu->reg<CPURegister::REG_HL>());
+  return 8;
+}
+
+//=================================STACK=========================
+template <CPURegister R> int pop_r16(CPU *cpu, d16_t) {
+  cpu->reg<R>(cpu->pop());
+  return 12;
+}
+
+template <CPURegister R> int push_r16(CPU *cpu, d16_t) {
+  cpu->push(cpu->reg<R>());
+  return 16;
+}
+
+//=================================JUMP/CALL=========================
+int jp_a16(CPU *cpu, d16_t operand) {
+  cpu->reg<CPURegister::REG_PC>(operand);
+  return 16;
+}
+
+template <JumpCC CC> int jp_cc_a16(CPU *cpu, d16_t operand) {
+  if (test_condition(cpu, CC)) {
+    cpu->reg<CPURegister::REG_PC>(operand);
+    return 16;
+  }
+  return 12;
+}
+
+int jp_hlp(CPU *cpu, d16_t) {
+  cpu->reg<CPURegister::REG_PC>(cpu->reg<CPURegister::REG_HL>());
+  return 4;
+}
+
+int jr_r8(CPU *cpu, d16_t operand) {
+  a16_t addr = cpu->reg<CPURegister::REG_PC>();
+  addr += static_cast<r8_t>(operand);
+  cpu->reg<CPURegister::REG_PC>(addr);
+  return 12;
+}
+
+template <JumpCC CC> int jr_cc_r8(CPU *cpu, d16_t operand) {
+  if (test_condition(cpu, CC)) {
+    a16_t addr = cpu->reg<CPURegister::REG_PC>();
+    addr += static_cast<r8_t>(operand);
+    cpu->reg<CPURegister::REG_PC>(addr);
+    return 12;
+  }
+  return 8;
+}
+
+int call_a16(CPU *cpu, d16_t operand) {
+  cpu->push(cpu->reg<CPURegister::REG_PC>());
+  cpu->reg<CPURegister::REG_PC>(operand);
+  return 24;
+}
+
+template <JumpCC CC> int call_cc_a16(CPU *cpu, d16_t operand) {
+  if (test_condition(cpu, CC)) {
+    cpu->push(cpu->reg<CPURegister::REG_PC>());
+    cpu->reg<CPURegister::REG_PC>(operand);
+    return 24;
+  }
+  return 12;
+}
+
+int ret(CPU *cpu, d16_t) {
+  cpu->reg<CPURegister::REG_PC>(cpu->pop());
+  return 16;
+}
+
+template <JumpCC CC> int ret_cc(CPU *cpu, d16_t) {
+  if (test_condition(cpu, CC)) {
+    cpu->reg<CPURegister::REG_PC>(cpu->pop());
+    return 20;
+  }
+  return 8;
+}
+
+int reti(CPU *cpu, d16_t) {
+  cpu->enable_all_interrupt();
+  cpu->reg<CPURegister::REG_PC>(cpu->pop());
+  return 16;
+}
+
+template <vec_t VEC> int rst(CPU *cpu, d16_t) {
+  cpu->push(cpu->reg<CPURegister::REG_PC>());
+  cpu->reg<CPURegister::REG_PC>(VEC);
+  return 16;
+}
+
+//=================================MISC=========================
+int nop(CPU *cpu, d16_t) { return 4; }
+
+int stop(CPU *cpu, d16_t) {
+  cpu->stop();
+  return 4;
+}
+
+int halt(CPU *cpu, d16_t) {
+  cpu->halt();
+  return 4;
+}
+
+int di(CPU *cpu, d16_t) {
+  cpu->disable_all_interrupt();
+  return 4;
+}
+
+int ei(CPU *cpu, d16_t) {
+  cpu->ei();
+  return 4;
+}
+
+int ccf(CPU *cpu, d16_t) {
+  cpu->set_flag(CPUFlagReg::FLAG_SUB, false);
+  cpu->set_flag(CPUFlagReg::FLAG_HALF_CARRY, false);
+  auto c = cpu->test_flag(CPUFlagReg::FLAG_CARRY);
+  cpu->set_flag(CPUFlagReg::FLAG_CARRY, !c);
+  return 4;
+}
+
+int scf(CPU *cpu, d16_t) {
+  cpu->set_flag(CPUFlagReg::FLAG_SUB, false);
+  cpu->set_flag(CPUFlagReg::FLAG_HALF_CARRY, false);
+  cpu->set_flag(CPUFlagReg::FLAG_CARRY, true);
+  return 4;
+}
+
+int cpl(CPU *cpu, d16_t) {
+  reg8_t dest = cpu->reg<CPURegister::REG_A>();
+  dest = ~dest;
+  cpu->reg<CPURegister::REG_A>(dest);
+  cpu->set_flag(CPUFlagReg::FLAG_SUB, true);
+  cpu->set_flag(CPUFlagReg::FLAG_HALF_CARRY, true);
+  return 4;
+}
+
+int daa(CPU *cpu, d16_t) {
+  int correction = 0;
+  auto flag_n = cpu->test_flag(CPUFlagReg::FLAG_SUB);
+  auto flag_h = cpu->test_flag(CPUFlagReg::FLAG_HALF_CARRY);
+  auto flag_c = cpu->test_flag(CPUFlagReg::FLAG_CARRY);
+
+  reg8_t value = cpu->reg<CPURegister::REG_A>();
+  auto result_c = false;
+
+  if (flag_h || (!flag_n && (value & 0xf) > 9)) {
+    correction += 0x6;
+  }
+
+  if (flag_c || (!flag_n && value > 0x99)) {
+    correction += 0x60;
+    result_c = true;
+  }
+
+  value += flag_n ? -correction : correction;
+
+  cpu->reg<CPURegister::REG_A>(value);
+
+  cpu->set_flag(CPUFlagReg::FLAG_ZERO, value == 0);
+  cpu->set_flag(CPUFlagReg::FLAG_HALF_CARRY, false);
+  cpu->set_flag(CPUFlagReg::FLAG_CARRY, result_c);
+  return 4;
+}
+
+//=================================ROTATE/SHIFT=========================
+enum ShiftOperation {
+  SHIFT_RLC,
+  SHIFT_RRC,
+  SHIFT_RL,
+  SHIFT_RR,
+  SHIFT_SLA,
+  SHIFT_SRA,
+  SHIFT_SWAP,
+  SHIFT_SRL,
+};
+
+inline reg8_t shift_exec(CPU *cpu, ShiftOperation op, reg8_t value) {
+  reg8_t result = 0;
+  bool carry = false;
+  switch (op) {
+  case SHIFT_RLC:
+    result = value << 1 | value >> 7;
+    carry = value >> 7;
+    break;
+  case SHIFT_RRC:
+    result = (value >> 1) | ((value & 0x1) << 7);
+    carry = value & 0x1;
+    break;
+  case SHIFT_RL:
+    result = value << 1 | reg8_t(cpu->test_flag(CPUFlagReg::FLAG_CARRY));
+    carry = value >> 7;
+    break;
+  case SHIFT_RR:
+    result = reg8_t(cpu->test_flag(CPUFlagReg::FLAG_CARRY)) << 7 | value >> 1;
+    carry = value & 0x1;
+    break;
+  case SHIFT_SLA:
+    result = value << 1;
+    carry = value >> 7;
+    break;
+  case SHIFT_SRA:
+    result = value >> 1 | (value & 0x80);
+    carry = value & 0x1;
+    break;
+  case SHIFT_SWAP:
+    result = value << 4 | value >> 4;
+    carry = false;
+    break;
+  case SHIFT_SRL:
+    result = value >> 1;
+    carry = value & 0x1;
+    break;
+  }
+  cpu->lazy_flags(LAZY_FLAGS_ZERO, result,
+                  carry ? 1 << CPUFlagReg::FLAG_CARRY : 0);
+  return result;
+}
+
+// RLCA/RRCA/RLA/RRA always clear the zero flag
+template <ShiftOperation OP> int shift_a(CPU *cpu, d16_t) {
+  cpu->reg<CPURegister::REG_A>(
+      shift_exec(cpu, OP, cpu->reg<CPURegister::REG_A>()));
+  cpu->set_flag(CPUFlagReg::FLAG_ZERO, false);
+  return 4;
+}
+
+//=================================CB PREFIX=========================
+template <byte OP> int cb_exec(CPU *cpu, d16_t) {
+  typedef R8Operand<OP & 0x7> Operand;
+  constexpr bool is_hlp = (OP & 0x7) == 6;
+  constexpr int bit = (OP >> 3) & 0x7;
+
+  reg8_t value = Operand::get(cpu);
+  switch (OP >> 6) {
+  case 0:
+    Operand::set(cpu, shift_exec(cpu, static_cast<ShiftOperation>(bit), value));
+    break;
+  case 1:
+    cpu->set_flag(CPUFlagReg::FLAG_ZERO, (value & (1U << bit)) == 0);
+    cpu->set_flag(CPUFlagReg::FLAG_SUB, false);
+    cpu->set_flag(CPUFlagReg::FLAG_HALF_CARRY, true);
+    return is_hlp ? 12 : 8;
+  case 2:
+    Operand::set(cpu, value & (~(1U << bit)));
+    break;
+  case 3:
+    Operand::set(cpu, value | (1U << bit));
+    break;
+  }
+  return is_hlp ? 16 : 8;
+}
+
+int prefix_cb(CPU *cpu, d16_t operand) {
+  return InstructionTable::cb_entry(operand & 0xff).handler(cpu, 0);
+}
+
+int invalid(CPU *cpu, d16_t) {
+  throw decode_exception("unknown instruction ");
+}
+} // namespace
+
+#define R_B 0
+#define R_C 1
+#define R_D 2
+#define R_E 3
+#define R_H 4
+#define R_L 5
+#define R_HLP 6
+#define R_A 7
+
+// the 0x40-0xBF block and the CB matrix are fully regular, so let the
+// compiler spell them out from the operand encoding
+#define MATRIX_ROW(entry, op)                                                  \
+  entry(op), entry(op + 1), entry(op + 2), entry(op + 3), entry(op + 4),       \
+      entry(op + 5), entry(op + 6), entry(op + 7)
+#define MATRIX_ROWS(entry, op)                                                 \
+  MATRIX_ROW(entry, op), MATRIX_ROW(entry, op + 0x08),                         \
+      MATRIX_ROW(entry, op + 0x10), MATRIX_ROW(entry, op + 0x18),              \
+      MATRIX_ROW(entry, op + 0x20), MATRIX_ROW(entry, op + 0x28),              \
+      MATRIX_ROW(entry, op + 0x30), MATRIX_ROW(entry, op + 0x38)
+
+// LD (HL),(HL) is HALT
+#define LD_ENTRY(op)                                                           \
+  (op) == 0x76                                                                 \
+      ? InstructionEntry{halt, 1, 4, INST_ENDS_BLOCK}                          \
+      : InstructionEntry{                                                      \
+            ld_r8_r8<((op) >> 3) & 0x7, (op)&0x7>, 1,                          \
+            static_cast<uint8_t>(((op)&0x7) == 6 || (((op) >> 3) & 0x7) == 6   \
+                                     ? 8                                       \
+                                     : 4),                                     \
+            static_cast<uint8_t>(                                              \
+                (((op) >> 3) & 0x7) == 6                                       \
+                    ? INST_MEM_HL | INST_WRITE                                 \
+                    : (((op)&0x7) == 6 ? INST_MEM_HL : 0))}
+#define ALU_ENTRY(op)                                                          \
+  {alu_r8<static_cast<ALUOperation>(((op) >> 3) & 0x7), (op)&0x7>, 1,          \
+   static_cast<uint8_t>(((op)&0x7) == 6 ? 8 : 4),                              \
+   static_cast<uint8_t>(((op)&0x7) == 6 ? INST_MEM_HL : 0)}
+
+const InstructionEntry InstructionTable::main_[256] = {
+    /*0x00*/ {nop, 1, 4, 0},
+    /*0x01*/ {ld_r16_d16<CPURegister::REG_BC>, 3, 12, 0},
+    /*0x02*/ {ld_r16p_a<CPURegister::REG_BC>, 1, 8, INST_MEM_BC | INST_WRITE},
+    /*0x03*/ {inc_r16<CPURegister::REG_BC>, 1, 8, 0},
+    /*0x04*/ {inc_r8<R_B>, 1, 4, 0},
+    /*0x05*/ {dec_r8<R_B>, 1, 4, 0},
+    /*0x06*/ {ld_r8_d8<R_B>, 2, 8, 0},
+    /*0x07*/ {shift_a<SHIFT_RLC>, 1, 4, 0},
+    /*0x08*/ {ld_a16p_sp, 3, 20, INST_MEM_A16 | INST_WRITE | INST_WIDE},
+    /*0x09*/ {add_hl_r16<CPURegister::REG_BC>, 1, 8, 0},
+    /*0x0a*/ {ld_a_r16p<CPURegister::REG_BC>, 1, 8, INST_MEM_BC},
+    /*0x0b*/ {dec_r16<CPURegister::REG_BC>, 1, 8, 0},
+    /*0x0c*/ {inc_r8<R_C>, 1, 4, 0},
+    /*0x0d*/ {dec_r8<R_C>, 1, 4, 0},
+    /*0x0e*/ {ld_r8_d8<R_C>, 2, 8, 0},
+    /*0x0f*/ {shift_a<SHIFT_RRC>, 1, 4, 0},
+    /*0x10*/ {stop, 1, 4, INST_ENDS_BLOCK},
+    /*0x11*/ {ld_r16_d16<CPURegister::REG_DE>, 3, 12, 0},
+    /*0x12*/ {ld_r16p_a<CPURegister::REG_DE>, 1, 8, INST_MEM_DE | INST_WRITE},
+    /*0x13*/ {inc_r16<CPURegister::REG_DE>, 1, 8, 0},
+    /*0x14*/ {inc_r8<R_D>, 1, 4, 0},
+    /*0x15*/ {dec_r8<R_D>, 1, 4, 0},
+    /*0x16*/ {ld_r8_d8<R_D>, 2, 8, 0},
+    /*0x17*/ {shift_a<SHIFT_RL>, 1, 4, 0},
+    /*0x18*/ {jr_r8, 2, 12, INST_ENDS_BLOCK},
+    /*0x19*/ {add_hl_r16<CPURegister::REG_DE>, 1, 8, 0},
+    /*0x1a*/ {ld_a_r16p<CPURegister::REG_DE>, 1, 8, INST_MEM_DE},
+    /*0x1b*/ {dec_r16<CPURegister::REG_DE>, 1, 8, 0},
+    /*0x1c*/ {inc_r8<R_E>, 1, 4, 0},
+    /*0x1d*/ {dec_r8<R_E>, 1, 4, 0},
+    /*0x1e*/ {ld_r8_d8<R_E>, 2, 8, 0},
+    /*0x1f*/ {shift_a<SHIFT_RR>, 1, 4, 0},
+    /*0x20*/ {jr_cc_r8<JumpCC::CC_NZ>, 2, 8, INST_ENDS_BLOCK},
+    /*0x21*/ {ld_r16_d16<CPURegister::REG_HL>, 3, 12, 0},
+    /*0x22*/ {ldi_hlp_a, 1, 8, INST_MEM_HL | INST_WRITE},
+    /*0x23*/ {inc_r16<CPURegister::REG_HL>, 1, 8, 0},
+    /*0x24*/ {inc_r8<R_H>, 1, 4, 0},
+    /*0x25*/ {dec_r8<R_H>, 1, 4, 0},
+    /*0x26*/ {ld_r8_d8<R_H>, 2, 8, 0},
+    /*0x27*/ {daa, 1, 4, 0},
+    /*0x28*/ {jr_cc_r8<JumpCC::CC_Z>, 2, 8, INST_ENDS_BLOCK},
+    /*0x29*/ {add_hl_r16<CPURegister::REG_HL>, 1, 8, 0},
+    /*0x2a*/ {ldi_a_hlp, 1, 8, INST_MEM_HL},
+    /*0x2b*/ {dec_r16<CPURegister::REG_HL>, 1, 8, 0},
+    /*0x2c*/ {inc_r8<R_L>, 1, 4, 0},
+    /*0x2d*/ {dec_r8<R_L>, 1, 4, 0},
+    /*0x2e*/ {ld_r8_d8<R_L>, 2, 8, 0},
+    /*0x2f*/ {cpl, 1, 4, 0},
+    /*0x30*/ {jr_cc_r8<JumpCC::CC_NC>, 2, 8, INST_ENDS_BLOCK},
+    /*0x31*/ {ld_r16_d16<CPURegister::REG_SP>, 3, 12, 0},
+    /*0x32*/ {ldd_hlp_a, 1, 8, INST_MEM_HL | INST_WRITE},
+    /*0x33*/ {inc_r16<CPURegister::REG_SP>, 1, 8, 0},
+    /*0x34*/ {inc_r8<R_HLP>, 1, 12, INST_MEM_HL | INST_WRITE},
+    /*0x35*/ {dec_r8<R_HLP>, 1, 12, INST_MEM_HL | INST_WRITE},
+    /*0x36*/ {ld_r8_d8<R_HLP>, 2, 12, INST_MEM_HL | INST_WRITE},
+    /*0x37*/ {scf, 1, 4, 0},
+    /*0x38*/ {jr_cc_r8<JumpCC::CC_C>, 2, 8, INST_ENDS_BLOCK},
+    /*0x39*/ {add_hl_r16<CPURegister::REG_SP>, 1, 8, 0},
+    /*0x3a*/ {ldd_a_hlp, 1, 8, INST_MEM_HL},
+    /*0x3b*/ {dec_r16<CPURegister::REG_SP>, 1, 8, 0},
+    /*0x3c*/ {inc_r8<R_A>, 1, 4, 0},
+    /*0x3d*/ {dec_r8<R_A>, 1, 4, 0},
+    /*0x3e*/ {ld_r8_d8<R_A>, 2, 8, 0},
+    /*0x3f*/ {ccf, 1, 4, 0},
+    /*0x40*/ MATRIX_ROWS(LD_ENTRY, 0x40),
+    /*0x80*/ MATRIX_ROWS(ALU_ENTRY, 0x80),
+    /*0xc0*/ {ret_cc<JumpCC::CC_NZ>, 1, 8, INST_ENDS_BLOCK | INST_MEM_SP},
+    /*0xc1*/ {pop_r16<CPURegister::REG_BC>, 1, 12, INST_MEM_SP},
+    /*0xc2*/ {jp_cc_a16<JumpCC::CC_NZ>, 3, 12, INST_ENDS_BLOCK},
+    /*0xc3*/ {jp_a16, 3, 16, INST_ENDS_BLOCK},
+    /*0xc4*/ {call_cc_a16<JumpCC::CC_NZ>, 3, 12,
+              INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xc5*/ {push_r16<CPURegister::REG_BC>, 1, 16, INST_MEM_SP | INST_WRITE},
+    /*0xc6*/ {alu_d8<ALU_ADD>, 2, 8, 0},
+    /*0xc7*/ {rst<0x00>, 1, 16, INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xc8*/ {ret_cc<JumpCC::CC_Z>, 1, 8, INST_ENDS_BLOCK | INST_MEM_SP},
+    /*0xc9*/ {ret, 1, 16, INST_ENDS_BLOCK | INST_MEM_SP},
+    /*0xca*/ {jp_cc_a16<JumpCC::CC_Z>, 3, 12, INST_ENDS_BLOCK},
+    /*0xcb*/ {prefix_cb, 2, 8, 0},
+    /*0xcc*/ {call_cc_a16<JumpCC::CC_Z>, 3, 12,
+              INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xcd*/ {call_a16, 3, 24, INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xce*/ {alu_d8<ALU_ADC>, 2, 8, 0},
+    /*0xcf*/ {rst<0x08>, 1, 16, INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xd0*/ {ret_cc<JumpCC::CC_NC>, 1, 8, INST_ENDS_BLOCK | INST_MEM_SP},
+    /*0xd1*/ {pop_r16<CPURegister::REG_DE>, 1, 12, INST_MEM_SP},
+    /*0xd2*/ {jp_cc_a16<JumpCC::CC_NC>, 3, 12, INST_ENDS_BLOCK},
+    /*0xd3*/ {invalid, 1, 0, INST_ENDS_BLOCK},
+    /*0xd4*/ {call_cc_a16<JumpCC::CC_NC>, 3, 12,
+              INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xd5*/ {push_r16<CPURegister::REG_DE>, 1, 16, INST_MEM_SP | INST_WRITE},
+    /*0xd6*/ {alu_d8<ALU_SUB>, 2, 8, 0},
+    /*0xd7*/ {rst<0x10>, 1, 16, INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xd8*/ {ret_cc<JumpCC::CC_C>, 1, 8, INST_ENDS_BLOCK | INST_MEM_SP},
+    /*0xd9*/ {reti, 1, 16, INST_ENDS_BLOCK | INST_MEM_SP},
+    /*0xda*/ {jp_cc_a16<JumpCC::CC_C>, 3, 12, INST_ENDS_BLOCK},
+    /*0xdb*/ {invalid, 1, 0, INST_ENDS_BLOCK},
+    /*0xdc*/ {call_cc_a16<JumpCC::CC_C>, 3, 12,
+              INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xdd*/ {invalid, 1, 0, INST_ENDS_BLOCK},
+    /*0xde*/ {alu_d8<ALU_SBC>, 2, 8, 0},
+    /*0xdf*/ {rst<0x18>, 1, 16, INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xe0*/ {ldh_a8_a, 2, 12, INST_MEM_A8 | INST_WRITE},
+    /*0xe1*/ {pop_r16<CPURegister::REG_HL>, 1, 12, INST_MEM_SP},
+    /*0xe2*/ {ld_cp_a, 1, 8, INST_MEM_C | INST_WRITE},
+    /*0xe3*/ {invalid, 1, 0, INST_ENDS_BLOCK},
+    /*0xe4*/ {invalid, 1, 0, INST_ENDS_BLOCK},
+    /*0xe5*/ {push_r16<CPURegister::REG_HL>, 1, 16, INST_MEM_SP | INST_WRITE},
+    /*0xe6*/ {alu_d8<ALU_AND>, 2, 8, 0},
+    /*0xe7*/ {rst<0x20>, 1, 16, INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xe8*/ {add_sp_r8, 2, 16, 0},
+    /*0xe9*/ {jp_hlp, 1, 4, INST_ENDS_BLOCK},
+    /*0xea*/ {ld_a16_a, 3, 16, INST_MEM_A16 | INST_WRITE},
+    /*0xeb*/ {invalid, 1, 0, INST_ENDS_BLOCK},
+    /*0xec*/ {invalid, 1, 0, INST_ENDS_BLOCK},
+    /*0xed*/ {invalid, 1, 0, INST_ENDS_BLOCK},
+    /*0xee*/ {alu_d8<ALU_XOR>, 2, 8, 0},
+    /*0xef*/ {rst<0x28>, 1, 16, INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xf0*/ {ldh_a_a8, 2, 12, INST_MEM_A8},
+    /*0xf1*/ {pop_r16<CPURegister::REG_AF>, 1, 12, INST_MEM_SP},
+    /*0xf2*/ {ld_a_cp, 1, 8, INST_MEM_C},
+    /*0xf3*/ {di, 1, 4, 0},
+    /*0xf4*/ {invalid, 1, 0, INST_ENDS_BLOCK},
+    /*0xf5*/ {push_r16<CPURegister::REG_AF>, 1, 16, INST_MEM_SP | INST_WRITE},
+    /*0xf6*/ {alu_d8<ALU_OR>, 2, 8, 0},
+    /*0xf7*/ {rst<0x30>, 1, 16, INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+    /*0xf8*/ {ldhl_sp_r8, 2, 12, 0},
+    /*0xf9*/ {ld_sp_hl, 1, 8, 0},
+    /*0xfa*/ {ld_a_a16, 3, 16, INST_MEM_A16},
+    /*0xfb*/ {ei, 1, 4, 0},
+    /*0xfc*/ {invalid, 1, 0, INST_ENDS_BLOCK},
+    /*0xfd*/ {invalid, 1, 0, INST_ENDS_BLOCK},
+    /*0xfe*/ {alu_d8<ALU_CP>, 2, 8, 0},
+    /*0xff*/ {rst<0x38>, 1, 16, INST_ENDS_BLOCK | INST_MEM_SP | INST_WRITE},
+};
+
+#undef R_B
+#undef R_C
+#undef R_D
+#undef R_E
+#undef R_H
+#undef R_L
+#undef R_HLP
+#undef R_A
+#undef ALU_ENTRY
+#undef LD_ENTRY
+
+#define CB_ENTRY(op)                                                           \
+  {cb_exec<(op)>, 2,                                                           \
+   static_cast<uint8_t>(((op)&0x7) != 6 ? 8 : (((op) >> 6) == 1 ? 12 : 16)),  \
+   static_cast<uint8_t>(((op)&0x7) != 6                                        \
+                            ? 0                                                \
+                            : (((op) >> 6) == 1 ? INST_MEM_HL                  \
+                                                : INST_MEM_HL | INST_WRITE))}
+
+const InstructionEntry InstructionTable::cb_[256] = {
+    MATRIX_ROWS(CB_ENTRY, 0x00), MATRIX_ROWS(CB_ENTRY, 0x40),
+    MATRIX_ROWS(CB_ENTRY, 0x80), MATRIX_ROWS(CB_ENTRY, 0xC0)};
+
+#undef CB_ENTRY
+#undef MATRIX_ROWS
+#undef MATRIX_ROW
+
+void InstructionTable::decode(const CPU *cpu, a16_t addr,
+                              DecodedInstruction *inst) {
+  decode(cpu, addr, a16_t(addr + 1), inst);
+}
+
+void InstructionTable::decode_halt_bug(const CPU *cpu, a16_t addr,
+                                       DecodedInstruction *inst) {
+  decode(cpu, addr, addr, inst);
+}
+
+void InstructionTable::decode(const CPU *cpu, a16_t addr, a16_t operand_addr,
+                              DecodedInstruction *inst) {
+  byte opcode = cpu->memory(addr);
+  const InstructionEntry *e = &main_[opcode];
+  d16_t operand = 0;
+  if (e->length == 2) {
+    operand = cpu->memory(operand_addr);
+  } else if (e->length == 3) {
+    operand = cpu->memory(operand_addr);
+    operand |= cpu->memory(a16_t(operand_addr + 1)) << 8;
+  }
+  if (e->handler == prefix_cb) {
+    e = &cb_[operand & 0xff];
+  }
+  inst->handler = e->handler;
+  inst->operand = operand;
+  inst->length = e->length;
+  inst->cycles = e->cycles;
+  inst->flags = e->flags;
+  inst->opcode = opcode;
+}
+
+int InstructionTable::execute(CPU *cpu) {
+  DecodedInstruction inst;
+  decode(cpu, cpu->reg<CPURegister::REG_PC>(), &inst);
+  return execute(cpu, inst);
+}
+
+} // namespace GB
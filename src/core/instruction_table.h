@@ -0,0 +1,85 @@
+#pragma once
+
+#include "cpu.h"
+#include "hardware.h"
+
+namespace GB {
+
+/*
+  Allocation-free dispatch of the LR35902 instruction set.
+
+  Every opcode (and every CB-prefixed opcode) owns one entry of a static
+  256-slot table. The operand bytes are fetched generically by the length of
+  the entry, so a handler only receives the already assembled operand
+  (d8/a8/r8 in the low byte, d16/a16 little-endian) and runs straight
+  against the CPU state.
+*/
+typedef int (*InstructionHandler)(CPU *cpu, d16_t operand);
+
+// what an instruction does besides touching registers
+enum InstructionFlags {
+  INST_ENDS_BLOCK = 0x01, // jumps, calls, returns, HALT, STOP and unknown ones
+  INST_WRITE = 0x02,      // the memory operand is written
+  INST_WIDE = 0x04,       // the memory operand is 16 bits wide
+
+  // where the memory operand lives
+  INST_MEM_HL = 0x10,
+  INST_MEM_BC = 0x20,
+  INST_MEM_DE = 0x30,
+  INST_MEM_SP = 0x40, // the 2 bytes pushed or popped
+  INST_MEM_A16 = 0x50,
+  INST_MEM_A8 = 0x60, // 0xFF00 + a8
+  INST_MEM_C = 0x70,  // 0xFF00 + C
+  INST_MEM_MASK = 0x70,
+};
+
+struct InstructionEntry {
+  InstructionHandler handler;
+  uint8_t length; // bytes including the opcode (CB prefixed ones count 2)
+  uint8_t cycles; // base clock cost (the not-taken one for conditionals)
+  uint8_t flags;  // InstructionFlags
+};
+
+// an instruction with its operand already fetched, CB prefixed opcodes are
+// resolved to their own handler
+struct DecodedInstruction {
+  InstructionHandler handler;
+  d16_t operand;
+  uint8_t length;
+  uint8_t cycles;
+  uint8_t flags;
+  uint8_t opcode; // 0xCB for the prefixed ones
+};
+
+class InstructionTable final {
+public:
+  static const InstructionEntry &entry(byte opcode) { return main_[opcode]; }
+  static const InstructionEntry &cb_entry(byte opcode) { return cb_[opcode]; }
+
+  // decode the instruction at addr without touching PC
+  static void decode(const CPU *cpu, a16_t addr, DecodedInstruction *inst);
+  // the same with the opcode byte read twice, as the HALT bug does: the
+  // operand starts at addr and inst is one byte shorter in memory
+  static void decode_halt_bug(const CPU *cpu, a16_t addr,
+                              DecodedInstruction *inst);
+
+  // advance PC past inst and run it, returns the clock cost
+  static int execute(CPU *cpu, const DecodedInstruction &inst) {
+    cpu->reg(CPURegister::REG_PC,
+             a16_t(cpu->reg(CPURegister::REG_PC) + inst.length));
+    return inst.handler(cpu, inst.operand);
+  }
+
+  // fetch, decode and execute the instruction at PC, returns the clock cost
+  static int execute(CPU *cpu);
+
+private:
+  static void decode(const CPU *cpu, a16_t addr, a16_t operand_addr,
+                     DecodedInstruction *inst);
+
+private:
+  static const InstructionEntry main_[256];
+  static const InstructionEntry cb_[256];
+};
+
+} // namespace GB
@@ -0,0 +1,988 @@
+#include "jit_compiler.h"
+#include "common.h"
+#include <cassert>
+#include <cstring>
+#include <initializer_list>
+
+#ifdef GB_JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace GB {
+constexpr size_t JIT_CODE_CACHE_SIZE = 4 * 1024 * 1024;
+
+#ifdef GB_JIT_X86_64
+namespace {
+// operand order of the opcode matrix: B,C,D,E,H,L,[HL],A
+constexpr CPURegister R8_OPERANDS[] = {
+    CPURegister::REG_B, CPURegister::REG_C, CPURegister::REG_D,
+    CPURegister::REG_E, CPURegister::REG_H, CPURegister::REG_L,
+    CPURegister::REG_MAX, CPURegister::REG_A};
+
+// condition order of JR cc / JP cc
+constexpr JumpCC CONDITIONS[] = {JumpCC::CC_NZ, JumpCC::CC_Z, JumpCC::CC_NC,
+                                 JumpCC::CC_C};
+
+// host registers by their x86 encoding
+enum HostReg : uint8_t {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15,
+};
+
+// x86 condition codes, cc ^ 1 is the opposite one
+enum HostCond : uint8_t {
+  COND_E = 0x4,
+  COND_NE = 0x5,
+  COND_A = 0x7,
+  COND_S = 0x8,
+  COND_L = 0xC,
+  COND_GE = 0xD,
+};
+
+// the x86 ALU operations, in the order of their opcodes
+enum HostAlu : uint8_t {
+  HOST_ADD,
+  HOST_OR,
+  HOST_ADC,
+  HOST_SBB,
+  HOST_AND,
+  HOST_SUB,
+  HOST_XOR,
+  HOST_CMP,
+};
+
+// the stack frame of a block: the caller's clocks counter, the budget, the
+// clocks run so far (written back at the exit) and a scratch slot
+constexpr uint8_t FRAME_CLOCKS_PTR = 0;
+constexpr uint8_t FRAME_BUDGET = 8;
+constexpr uint8_t FRAME_CLOCKS = 16;
+constexpr uint8_t FRAME_SCRATCH = 20;
+
+class Emitter final {
+public:
+  void u8(uint8_t v) { code_.push_back(v); }
+  void u16(uint16_t v) {
+    u8(v & 0xff);
+    u8(v >> 8);
+  }
+  void u32(uint32_t v) {
+    u16(v & 0xffff);
+    u16(v >> 16);
+  }
+  void u64(uint64_t v) {
+    u32(v & 0xffffffff);
+    u32(v >> 32);
+  }
+  void bytes(std::initializer_list<uint8_t> l) {
+    code_.insert(code_.end(), l.begin(), l.end());
+  }
+
+  // forced for byte registers, so that 4-7 are spl..dil and never ah..bh
+  void rex(bool wide, int reg, int rm, bool force = false) {
+    uint8_t v = 0x40 | (wide ? 8 : 0) | (reg & 8) >> 1 | (rm & 8) >> 3;
+    if (force || v != 0x40) {
+      u8(v);
+    }
+  }
+  void modrm(int reg, int rm) { u8(0xC0 | (reg & 7) << 3 | (rm & 7)); }
+  // [rbx+disp32], rbx holds the CPU
+  void cpu_operand(int reg, int32_t disp) {
+    u8(0x80 | (reg & 7) << 3 | RBX);
+    u32(disp);
+  }
+  // [rsp+disp8]
+  void frame_operand(int reg, uint8_t disp) {
+    u8(0x40 | (reg & 7) << 3 | RSP);
+    u8(0x24);
+    u8(disp);
+  }
+
+  void mov8(int dst, int src) {
+    rex(false, src, dst, true);
+    u8(0x88);
+    modrm(src, dst);
+  }
+  void mov32(int dst, int src) {
+    rex(false, src, dst);
+    u8(0x89);
+    modrm(src, dst);
+  }
+  void mov_imm(int dst, uint32_t v) {
+    rex(false, 0, dst);
+    u8(0xB8 | (dst & 7));
+    u32(v);
+  }
+  void mov_imm64(int dst, uint64_t v) {
+    rex(true, 0, dst);
+    u8(0xB8 | (dst & 7));
+    u64(v);
+  }
+  void movzx8(int dst, int src) {
+    rex(false, dst, src, true);
+    bytes({0x0F, 0xB6});
+    modrm(dst, src);
+  }
+  void alu8(HostAlu op, int dst, int src) {
+    rex(false, src, dst, true);
+    u8(op << 3);
+    modrm(src, dst);
+  }
+  void alu32(HostAlu op, int dst, int src) {
+    rex(false, src, dst);
+    u8(op << 3 | 1);
+    modrm(src, dst);
+  }
+  void alu32_imm(HostAlu op, int dst, int32_t v) {
+    rex(false, 0, dst);
+    if (v >= -128 && v < 128) {
+      u8(0x83);
+      modrm(op, dst);
+      u8(v & 0xff);
+    } else {
+      u8(0x81);
+      modrm(op, dst);
+      u32(v);
+    }
+  }
+  void shr32(int dst, uint8_t n) {
+    rex(false, 0, dst);
+    u8(0xC1);
+    modrm(5, dst);
+    u8(n);
+  }
+  // rol of the low word by 8, swapping its bytes
+  void swap16(int dst) {
+    u8(0x66);
+    rex(false, 0, dst);
+    u8(0xC1);
+    modrm(0, dst);
+    u8(8);
+  }
+  void inc16(int dst) {
+    u8(0x66);
+    rex(false, 0, dst);
+    u8(0xFF);
+    modrm(0, dst);
+  }
+  void dec16(int dst) {
+    u8(0x66);
+    rex(false, 0, dst);
+    u8(0xFF);
+    modrm(1, dst);
+  }
+  void test8(int a, int b) {
+    rex(false, b, a, true);
+    u8(0x84);
+    modrm(b, a);
+  }
+  void test32(int a, int b) {
+    rex(false, b, a);
+    u8(0x85);
+    modrm(b, a);
+  }
+  void setcc(HostCond cc, int dst) {
+    rex(false, 0, dst, true);
+    bytes({0x0F, uint8_t(0x90 | cc)});
+    modrm(0, dst);
+  }
+
+  // fields of the CPU
+  void load8(int dst, int32_t disp) {
+    rex(false, dst, RBX);
+    bytes({0x0F, 0xB6}); // movzx r32, byte
+    cpu_operand(dst, disp);
+  }
+  void load16(int dst, int32_t disp) {
+    rex(false, dst, RBX);
+    bytes({0x0F, 0xB7}); // movzx r32, word
+    cpu_operand(dst, disp);
+  }
+  void store8(int32_t disp, int src) {
+    rex(false, src, RBX, true);
+    u8(0x88);
+    cpu_operand(src, disp);
+  }
+  void store16(int32_t disp, int src) {
+    u8(0x66);
+    rex(false, src, RBX);
+    u8(0x89);
+    cpu_operand(src, disp);
+  }
+  void store8_imm(int32_t disp, uint8_t v) {
+    u8(0xC6);
+    cpu_operand(0, disp);
+    u8(v);
+  }
+  void store16_imm(int32_t disp, uint16_t v) {
+    bytes({0x66, 0xC7});
+    cpu_operand(0, disp);
+    u16(v);
+  }
+  void cmp8_imm(int32_t disp, uint8_t v) {
+    u8(0x80);
+    cpu_operand(7, disp);
+    u8(v);
+  }
+  void test8_imm(int32_t disp, uint8_t v) {
+    u8(0xF6);
+    cpu_operand(0, disp);
+    u8(v);
+  }
+
+  // slots of the stack frame
+  void load_frame(int dst, uint8_t disp, bool wide = false) {
+    rex(wide, dst, RSP);
+    u8(0x8B);
+    frame_operand(dst, disp);
+  }
+  void store_frame(uint8_t disp, int src, bool wide = false) {
+    rex(wide, src, RSP);
+    u8(0x89);
+    frame_operand(src, disp);
+  }
+  void cmp_frame(int reg, uint8_t disp) {
+    rex(false, reg, RSP);
+    u8(0x3B);
+    frame_operand(reg, disp);
+  }
+  void lea_frame(int dst, uint8_t disp) {
+    rex(true, dst, RSP);
+    u8(0x8D);
+    frame_operand(dst, disp);
+  }
+
+  void call(const void *fn) {
+    mov_imm64(RAX, reinterpret_cast<uint64_t>(fn));
+    bytes({0xFF, 0xD0}); // call rax
+  }
+  void mov_rdi_cpu() { bytes({0x48, 0x89, 0xDF}); } // mov rdi, rbx
+
+  // forward jumps, their rel32 is patched by bind()
+  size_t jcc(HostCond cc) {
+    bytes({0x0F, uint8_t(0x80 | cc)});
+    return rel32();
+  }
+  size_t jmp() {
+    u8(0xE9);
+    return rel32();
+  }
+  void bind(size_t jump) { bind(jump, code_.size()); }
+  void bind(size_t jump, size_t target) {
+    uint32_t rel = uint32_t(target - (jump + 4));
+    memcpy(&code_[jump], &rel, sizeof(rel));
+  }
+
+  size_t size() const { return code_.size(); }
+  const std::vector<uint8_t> &code() const { return code_; }
+
+private:
+  size_t rel32() {
+    u32(0);
+    return code_.size() - 4;
+  }
+
+private:
+  std::vector<uint8_t> code_;
+};
+
+// where the compiled code finds the CPU state, as offsets from the CPU
+struct CPULayout {
+  int32_t registers;
+  int32_t flags_op;
+  int32_t flags_dest;
+  int32_t flags_src;
+  int32_t flags_carry;
+};
+
+struct JitHelpers {
+  const void *step;
+  const void *materialize_flags;
+  const void *save_registers;
+  const void *check_registers;
+};
+
+// A, BC, DE, HL and SP live in callee-saved registers, which also keeps
+// them across the calls out of the block
+constexpr int PINNED_NUM = 5;
+constexpr HostReg PINNED[PINNED_NUM] = {RBP, R12, R13, R14, R15};
+constexpr CPURegister PINNED_PAIRS[PINNED_NUM] = {
+    CPURegister::REG_AF, CPURegister::REG_BC, CPURegister::REG_DE,
+    CPURegister::REG_HL, CPURegister::REG_SP};
+constexpr int PINNED_A = 0;
+constexpr int PINNED_HL = 3;
+constexpr int PINNED_SP = 4;
+
+constexpr int FLAGS_UNKNOWN = -1;
+
+bool is_jump(byte op) {
+  return op == 0x18 || (op & 0xE7) == 0x20 || op == 0xC3 ||
+         (op & 0xE7) == 0xC2 || op == 0xE9;
+}
+
+// whether the instruction is emitted natively, besides the jumps
+bool is_native(byte op) {
+  if (op == 0x00 || op == 0xF9) { // NOP, LD SP,HL
+    return true;
+  }
+  if (op >= 0x40 && op < 0x80) { // LD r,r
+    return (op & 0x7) != 6 && ((op >> 3) & 0x7) != 6;
+  }
+  if (op >= 0x80 && op < 0xC0) { // ALU A,r
+    return (op & 0x7) != 6;
+  }
+  if ((op & 0xC6) == 0x04 || (op & 0xC7) == 0x06) { // INC/DEC r, LD r,d8
+    return ((op >> 3) & 0x7) != 6;
+  }
+  // LD rr,d16, INC/DEC rr, ALU A,d8
+  return (op & 0xCF) == 0x01 || (op & 0xC7) == 0x03 || (op & 0xC7) == 0xC6;
+}
+
+/*
+  Emits one block. The GB registers are cached in the pinned host registers
+  as the block goes: valid_ holds the ones loaded, dirty_ the ones to write
+  back before anything outside the block looks at them. The same goes for
+  PC, which is only stored when a call or an exit needs it, and for the
+  lazy flags operation, known at compile time once an ALU op of the block
+  has set it.
+*/
+class BlockCompiler final {
+public:
+  BlockCompiler(const CPULayout &layout, const JitHelpers &helpers,
+                bool differential)
+      : layout_(layout), helpers_(helpers), differential_(differential),
+        valid_(0), dirty_(0), stored_pc_(-1), flags_(FLAGS_UNKNOWN) {}
+
+  const std::vector<uint8_t> &compile(const BasicBlock &block) {
+    prologue();
+    // the interpreter loop found the block at PC
+    stored_pc_ = block.addr;
+    a16_t pc = block.addr;
+    for (size_t i = 0; i < block.insts.size(); ++i) {
+      const auto &inst = block.insts[i];
+      a16_t next_pc = pc + inst.length;
+      bool last = i + 1 == block.insts.size();
+      bool jump = is_jump(inst.opcode);
+      assert(!jump || last);
+
+      if (jump || is_native(inst.opcode)) {
+        if (differential_) {
+          save_registers(pc);
+        }
+        if (jump) {
+          emit_jump(inst, next_pc);
+        } else {
+          emit_native(inst);
+          if (last) {
+            spill();
+            store_pc(next_pc);
+          }
+          e_.mov_imm(RAX, inst.cycles);
+        }
+        if (differential_) {
+          check_registers(inst, next_pc);
+        }
+        add_clocks_eax();
+        if (last) {
+          e_.cmp_frame(RCX, FRAME_BUDGET);
+          e_.setcc(COND_L, RAX);
+        } else {
+          check_budget(next_pc);
+        }
+      } else if (last || (inst.flags & INST_MEM_MASK) ||
+                 inst.opcode == 0xFB) {
+        // EI can leave an interrupt pending
+        step(inst, pc, next_pc, last);
+      } else {
+        call_handler(inst, next_pc);
+      }
+      pc = next_pc;
+    }
+    epilogue();
+    return e_.code();
+  }
+
+private:
+  int32_t reg_disp(CPURegister r) const {
+    return is_reg8(r) ? layout_.registers + reg8_index(r)
+                      : layout_.registers + reg16_index(r) * sizeof(reg16_t);
+  }
+  int32_t home(int slot) const {
+    return reg_disp(slot == PINNED_A ? CPURegister::REG_A : PINNED_PAIRS[slot]);
+  }
+  static int slot(CPURegister r) {
+    return r == CPURegister::REG_A ? PINNED_A
+                                   : 1 + (r - CPURegister::REG_B) / 2;
+  }
+  static bool high(CPURegister r) {
+    return r == CPURegister::REG_B || r == CPURegister::REG_D ||
+           r == CPURegister::REG_H;
+  }
+
+  void use(int slot) {
+    if (valid_ & (1 << slot)) {
+      return;
+    }
+    if (slot == PINNED_A) {
+      e_.load8(RBP, home(slot));
+    } else {
+      e_.load16(PINNED[slot], home(slot));
+    }
+    valid_ |= 1 << slot;
+  }
+  void define(int slot) {
+    valid_ |= 1 << slot;
+    dirty_ |= 1 << slot;
+  }
+  void spill(uint8_t slots) {
+    for (int slot = 0; slot < PINNED_NUM; ++slot) {
+      if (!(slots & (1 << slot))) {
+        continue;
+      } else if (slot == PINNED_A) {
+        e_.store8(home(slot), RBP);
+      } else {
+        e_.store16(home(slot), PINNED[slot]);
+      }
+    }
+  }
+  void spill() {
+    spill(dirty_);
+    dirty_ = 0;
+  }
+  // after a call which may have changed the registers
+  void forget() {
+    assert(dirty_ == 0);
+    valid_ = 0;
+    flags_ = FLAGS_UNKNOWN;
+  }
+  void store_pc(a16_t pc) {
+    if (stored_pc_ != pc) {
+      e_.store16_imm(reg_disp(CPURegister::REG_PC), pc);
+      stored_pc_ = pc;
+    }
+  }
+
+  // zero-extended into dst, the pinned registers keep their bits 16-31 clear
+  void read8(CPURegister r, HostReg dst) {
+    auto s = slot(r);
+    use(s);
+    if (high(r)) {
+      e_.mov32(dst, PINNED[s]);
+      e_.shr32(dst, 8);
+    } else {
+      e_.movzx8(dst, PINNED[s]);
+    }
+  }
+  void write8(CPURegister r, HostReg src) {
+    auto s = slot(r);
+    if (s == PINNED_A) {
+      e_.movzx8(RBP, src);
+    } else if (high(r)) {
+      use(s);
+      e_.swap16(PINNED[s]);
+      e_.mov8(PINNED[s], src);
+      e_.swap16(PINNED[s]);
+    } else {
+      use(s);
+      e_.mov8(PINNED[s], src);
+    }
+    define(s);
+  }
+
+  // what CPU::lazy_flags does, with src and carry in host registers or
+  // given as immediates when the register is negative
+  void lazy_flags(LazyFlagsOp op, HostReg dest, int src_reg, uint8_t src,
+                  int carry_reg) {
+    e_.store8_imm(layout_.flags_op, op);
+    e_.store8(layout_.flags_dest, dest);
+    if (src_reg >= 0) {
+      e_.store8(layout_.flags_src, src_reg);
+    } else {
+      e_.store8_imm(layout_.flags_src, src);
+    }
+    if (carry_reg >= 0) {
+      e_.store8(layout_.flags_carry, carry_reg);
+    } else {
+      e_.store8_imm(layout_.flags_carry, 0);
+    }
+    flags_ = op;
+  }
+  // F up to date, as INC/DEC and the carry readers need it. The helper only
+  // looks at F and the lazy operands, none of which is cached
+  void materialize_flags() {
+    if (flags_ == LAZY_FLAGS_NONE) {
+      return;
+    }
+    size_t skip = 0;
+    if (flags_ == FLAGS_UNKNOWN) {
+      e_.cmp8_imm(layout_.flags_op, LAZY_FLAGS_NONE);
+      skip = e_.jcc(COND_E);
+    }
+    e_.mov_rdi_cpu();
+    e_.call(helpers_.materialize_flags);
+    if (flags_ == FLAGS_UNKNOWN) {
+      e_.bind(skip);
+    }
+    flags_ = LAZY_FLAGS_NONE;
+  }
+
+  void emit_native(const DecodedInstruction &inst) {
+    auto op = inst.opcode;
+    auto r8 = R8_OPERANDS[(op >> 3) & 0x7];
+    auto pair = 1 + (op >> 4 & 0x3);
+    if (op == 0x00) { // NOP
+    } else if (op == 0xF9) { // LD SP,HL
+      use(PINNED_HL);
+      e_.mov32(PINNED[PINNED_SP], PINNED[PINNED_HL]);
+      define(PINNED_SP);
+    } else if (op >= 0x40 && op < 0x80) { // LD r,r
+      read8(R8_OPERANDS[op & 0x7], RCX);
+      write8(r8, RCX);
+    } else if (op >= 0x80 && op < 0xC0) { // ALU A,r
+      alu((op >> 3) & 0x7, R8_OPERANDS[op & 0x7], 0);
+    } else if ((op & 0xC7) == 0xC6) { // ALU A,d8
+      alu((op >> 3) & 0x7, CPURegister::REG_MAX, inst.operand & 0xff);
+    } else if ((op & 0xC7) == 0x06) { // LD r,d8
+      e_.mov_imm(RCX, inst.operand & 0xff);
+      write8(r8, RCX);
+    } else if ((op & 0xC6) == 0x04) { // INC/DEC r
+      auto inc = (op & 1) == 0;
+      materialize_flags();
+      read8(r8, RAX);
+      lazy_flags(inc ? LAZY_FLAGS_INC : LAZY_FLAGS_DEC, RAX, -1, 1, -1);
+      e_.mov32(RCX, RAX);
+      e_.alu32_imm(inc ? HOST_ADD : HOST_SUB, RCX, 1);
+      write8(r8, RCX);
+    } else if ((op & 0xCF) == 0x01) { // LD rr,d16
+      e_.mov_imm(PINNED[pair], inst.operand);
+      define(pair);
+    } else if ((op & 0xCF) == 0x03) { // INC rr
+      use(pair);
+      e_.inc16(PINNED[pair]);
+      define(pair);
+    } else { // DEC rr
+      use(pair);
+      e_.dec16(PINNED[pair]);
+      define(pair);
+    }
+  }
+
+  // ADD, ADC, SUB, SBC, AND, XOR, OR, CP of A with r, or with d8 when r is
+  // REG_MAX
+  void alu(int op, CPURegister r, uint8_t d8) {
+    bool carry = op == 1 || op == 3;
+    if (carry) {
+      materialize_flags(); // before the call clobbers the scratch registers
+    }
+    use(PINNED_A);
+    if (r == CPURegister::REG_MAX) {
+      e_.mov_imm(RCX, d8);
+    } else {
+      read8(r, RCX);
+    }
+    if (carry) {
+      e_.load8(RAX, reg_disp(CPURegister::REG_F));
+      e_.shr32(RAX, CPUFlagReg::FLAG_CARRY);
+      e_.alu32_imm(HOST_AND, RAX, 1);
+    }
+    switch (op) {
+    case 0: // ADD, ADC
+    case 1:
+    case 2: // SUB, SBC
+    case 3: {
+      auto host = op < 2 ? HOST_ADD : HOST_SUB;
+      lazy_flags(op < 2 ? LAZY_FLAGS_ADD : LAZY_FLAGS_SUB, RBP, RCX, 0,
+                 carry ? RAX : -1);
+      e_.alu8(host, RBP, RCX);
+      if (carry) {
+        e_.alu8(host, RBP, RAX);
+      }
+      define(PINNED_A);
+      break;
+    }
+    case 4: // AND
+    case 5: // XOR
+    case 6: // OR
+      e_.alu8(op == 4 ? HOST_AND : op == 5 ? HOST_XOR : HOST_OR, RBP, RCX);
+      lazy_flags(LAZY_FLAGS_ZERO, RBP, -1,
+                 op == 4 ? 1 << CPUFlagReg::FLAG_HALF_CARRY : 0, -1);
+      define(PINNED_A);
+      break;
+    default: // CP
+      lazy_flags(LAZY_FLAGS_SUB, RBP, RCX, 0, -1);
+      break;
+    }
+  }
+
+  // tests cc straight from the lazy operands when the operation is known,
+  // returns the x86 condition holding when it is met
+  HostCond condition(JumpCC cc) {
+    bool zero = cc == JumpCC::CC_Z || cc == JumpCC::CC_NZ;
+    if (flags_ == FLAGS_UNKNOWN) {
+      materialize_flags();
+    }
+    HostCond holds = COND_NE;
+    switch (flags_) {
+    case LAZY_FLAGS_ADD:
+    case LAZY_FLAGS_SUB: {
+      auto host = flags_ == LAZY_FLAGS_ADD ? HOST_ADD : HOST_SUB;
+      e_.load8(RAX, layout_.flags_dest);
+      e_.load8(RCX, layout_.flags_src);
+      e_.load8(RDX, layout_.flags_carry);
+      e_.alu32(host, RAX, RCX);
+      e_.alu32(host, RAX, RDX);
+      if (zero) {
+        e_.test8(RAX, RAX);
+        holds = COND_E;
+      } else if (flags_ == LAZY_FLAGS_ADD) {
+        e_.alu32_imm(HOST_CMP, RAX, 0xff);
+        holds = COND_A;
+      } else {
+        e_.test32(RAX, RAX);
+        holds = COND_S;
+      }
+      break;
+    }
+    case LAZY_FLAGS_INC:
+    case LAZY_FLAGS_DEC:
+      if (zero) {
+        e_.cmp8_imm(layout_.flags_dest, flags_ == LAZY_FLAGS_INC ? 0xff : 1);
+        holds = COND_E;
+      } else {
+        e_.test8_imm(reg_disp(CPURegister::REG_F), 0x10);
+      }
+      break;
+    case LAZY_FLAGS_ZERO:
+      if (zero) {
+        e_.cmp8_imm(layout_.flags_dest, 0);
+        holds = COND_E;
+      } else {
+        e_.test8_imm(layout_.flags_src, 0x10);
+      }
+      break;
+    default:
+      e_.test8_imm(reg_disp(CPURegister::REG_F), zero ? 0x80 : 0x10);
+      break;
+    }
+    auto negated = cc == JumpCC::CC_NZ || cc == JumpCC::CC_NC;
+    return negated ? HostCond(holds ^ 1) : holds;
+  }
+
+  // stores the new PC and leaves the clocks taken in eax
+  void emit_jump(const DecodedInstruction &inst, a16_t next_pc) {
+    auto op = inst.opcode;
+    auto pc_disp = reg_disp(CPURegister::REG_PC);
+    stored_pc_ = -1;
+    if (op == 0xE9) { // JP HL
+      use(PINNED_HL);
+      spill();
+      e_.store16(pc_disp, PINNED[PINNED_HL]);
+      e_.mov_imm(RAX, inst.cycles);
+      return;
+    }
+    bool relative = op == 0x18 || (op & 0xE7) == 0x20;
+    a16_t target =
+        relative ? a16_t(next_pc + int8_t(inst.operand & 0xff)) : inst.operand;
+    spill();
+    if (op == 0x18 || op == 0xC3) {
+      e_.store16_imm(pc_disp, target);
+      e_.mov_imm(RAX, inst.cycles);
+      return;
+    }
+    auto taken = e_.jcc(condition(CONDITIONS[(op >> 3) & 0x3]));
+    e_.store16_imm(pc_disp, next_pc);
+    e_.mov_imm(RAX, inst.cycles);
+    auto done = e_.jmp();
+    e_.bind(taken);
+    e_.store16_imm(pc_disp, target);
+    e_.mov_imm(RAX, inst.cycles + 4);
+    e_.bind(done);
+  }
+
+  // the interpreter replays the instruction over the saved state and
+  // compares, it stays authoritative. The clocks are kept in eax
+  void save_registers(a16_t pc) {
+    spill();
+    store_pc(pc);
+    e_.mov_rdi_cpu();
+    e_.call(helpers_.save_registers);
+  }
+  void check_registers(const DecodedInstruction &inst, a16_t next_pc) {
+    spill();
+    if (!is_jump(inst.opcode)) {
+      store_pc(next_pc);
+    }
+    e_.store_frame(FRAME_SCRATCH, RAX);
+    e_.mov32(RDX, RAX);
+    e_.mov_rdi_cpu();
+    e_.mov_imm64(RSI, reinterpret_cast<uint64_t>(&inst));
+    e_.call(helpers_.check_registers);
+    e_.load_frame(RAX, FRAME_SCRATCH);
+    forget();
+  }
+
+  void step(const DecodedInstruction &inst, a16_t pc, a16_t next_pc,
+            bool last) {
+    spill();
+    store_pc(pc);
+    e_.mov_rdi_cpu();
+    e_.mov_imm64(RSI, reinterpret_cast<uint64_t>(&inst));
+    e_.load_frame(RDX, FRAME_BUDGET);
+    e_.lea_frame(RCX, FRAME_CLOCKS);
+    e_.call(helpers_.step);
+    forget();
+    // going on means it ran and did not jump
+    stored_pc_ = next_pc;
+    if (!last) {
+      e_.test8(RAX, RAX);
+      stopped_.push_back(e_.jcc(COND_E));
+    }
+  }
+
+  void call_handler(const DecodedInstruction &inst, a16_t next_pc) {
+    spill();
+    store_pc(next_pc);
+    e_.mov_rdi_cpu();
+    e_.mov_imm(RSI, inst.operand);
+    e_.call(reinterpret_cast<const void *>(inst.handler));
+    forget();
+    add_clocks_eax();
+    check_budget(next_pc);
+  }
+
+  // the clocks run so far end up in ecx
+  void add_clocks_eax() {
+    e_.load_frame(RCX, FRAME_CLOCKS);
+    e_.alu32(HOST_ADD, RCX, RAX);
+    e_.store_frame(FRAME_CLOCKS, RCX);
+  }
+  // leaves the block once the budget is spent, through a stub writing back
+  // what is cached at this point
+  void check_budget(a16_t next_pc) {
+    e_.cmp_frame(RCX, FRAME_BUDGET);
+    BudgetExit exit = {e_.jcc(COND_GE), dirty_, stored_pc_, next_pc};
+    budget_exits_.push_back(exit);
+  }
+
+  void prologue() {
+    e_.bytes({0x53, 0x55, 0x41, 0x54, 0x41, 0x55}); // push rbx,rbp,r12,r13
+    e_.bytes({0x41, 0x56, 0x41, 0x57});             // push r14,r15
+    e_.bytes({0x48, 0x83, 0xEC, 0x18});             // sub rsp, 24
+    e_.bytes({0x48, 0x89, 0xFB});                   // mov rbx, rdi
+    e_.store_frame(FRAME_BUDGET, RSI);
+    e_.store_frame(FRAME_CLOCKS_PTR, RDX, true);
+    e_.bytes({0x8B, 0x02});             // mov eax, [rdx]
+    e_.store_frame(FRAME_CLOCKS, RAX);
+  }
+
+  // the last instruction already left its result in al
+  void epilogue() {
+    e_.bytes({0xEB, 0x02}); // jmp +2
+    size_t exit = e_.size();
+    e_.bytes({0x31, 0xC0});             // exit: xor eax, eax
+    e_.load_frame(RCX, FRAME_CLOCKS_PTR, true);
+    e_.load_frame(RDX, FRAME_CLOCKS);
+    e_.bytes({0x89, 0x11});             // mov [rcx], edx
+    e_.bytes({0x48, 0x83, 0xC4, 0x18}); // add rsp, 24
+    e_.bytes({0x41, 0x5F, 0x41, 0x5E}); // pop r15,r14
+    e_.bytes({0x41, 0x5D, 0x41, 0x5C}); // pop r13,r12
+    e_.bytes({0x5D, 0x5B, 0xC3});       // pop rbp,rbx; ret
+    for (auto jump : stopped_) {
+      e_.bind(jump, exit);
+    }
+    for (const auto &stub : budget_exits_) {
+      e_.bind(stub.jump);
+      spill(stub.dirty);
+      if (stub.stored_pc != stub.pc) {
+        e_.store16_imm(reg_disp(CPURegister::REG_PC), stub.pc);
+      }
+      e_.bind(e_.jmp(), exit);
+    }
+  }
+
+private:
+  struct BudgetExit {
+    size_t jump;
+    uint8_t dirty;
+    int stored_pc;
+    a16_t pc;
+  };
+
+  Emitter e_;
+  CPULayout layout_;
+  JitHelpers helpers_;
+  bool differential_;
+  uint8_t valid_;
+  uint8_t dirty_;
+  int stored_pc_; // what PC holds in memory, -1 when unknown
+  int flags_;     // the lazy flags operation, FLAGS_UNKNOWN at block entry
+  std::vector<size_t> stopped_; // jumps of the steps ending the batch
+  std::vector<BudgetExit> budget_exits_;
+};
+} // namespace
+#endif
+
+JitCompiler::JitCompiler(CPU *cpu, JitMode mode)
+    : cpu_(cpu), mode_(mode), code_(nullptr), code_size_(0), code_used_(0),
+      saved_flags_op_(LAZY_FLAGS_NONE), saved_flags_dest_(0),
+      saved_flags_src_(0), saved_flags_carry_(0), mismatches_(0) {
+  memset(&saved_registers_, 0, sizeof(saved_registers_));
+#ifdef GB_JIT_X86_64
+  // never writable and executable at once: compile() opens the pages of a
+  // block for the copy and makes them executable after it
+  void *p = mmap(nullptr, JIT_CODE_CACHE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    debug_log("failed to map the JIT code cache, keep interpreting");
+    return;
+  }
+  code_ = static_cast<byte *>(p);
+  code_size_ = JIT_CODE_CACHE_SIZE;
+#endif
+}
+
+JitCompiler::~JitCompiler() {
+  // the blocks outlive the code cache
+  flush();
+#ifdef GB_JIT_X86_64
+  if (code_ != nullptr) {
+    munmap(code_, code_size_);
+  }
+#endif
+}
+
+bool JitCompiler::supported() {
+#ifdef GB_JIT_X86_64
+  return true;
+#else
+  return false;
+#endif
+}
+
+#ifdef GB_JIT_X86_64
+bool JitCompiler::protect(byte *code, size_t size, int prot) {
+  static const uintptr_t page = sysconf(_SC_PAGESIZE);
+  auto addr = reinterpret_cast<uintptr_t>(code);
+  auto begin = addr & ~(page - 1);
+  auto end = (addr + size + page - 1) & ~(page - 1);
+  if (mprotect(reinterpret_cast<void *>(begin), end - begin, prot) != 0) {
+    debug_log("failed to protect the JIT code cache");
+    return false;
+  }
+  return true;
+}
+#endif
+
+void JitCompiler::flush() {
+  // they count up to the hot threshold again
+  for (auto block : compiled_) {
+    block->native = nullptr;
+    block->exec_count = 0;
+  }
+  compiled_.clear();
+  code_used_ = 0;
+}
+
+bool JitCompiler::step(CPU *cpu, const DecodedInstruction *inst,
+                       int max_clocks, int *clocks) {
+  return cpu->step_batched(*inst, max_clocks, clocks);
+}
+
+void JitCompiler::materialize_flags(CPU *cpu) { cpu->materialize_flags(); }
+
+void JitCompiler::save_registers(CPU *cpu) {
+  auto jit = cpu->jit_.get();
+  jit->saved_registers_ = cpu->_registers;
+  jit->saved_flags_op_ = cpu->flags_op_;
+  jit->saved_flags_dest_ = cpu->flags_dest_;
+  jit->saved_flags_src_ = cpu->flags_src_;
+  jit->saved_flags_carry_ = cpu->flags_carry_;
+}
+
+void JitCompiler::check_registers(CPU *cpu, const DecodedInstruction *inst,
+                                  int clocks) {
+  auto jit = cpu->jit_.get();
+  auto native = cpu->_registers;
+  native.r8[reg8_index(CPURegister::REG_F)] = cpu->flags();
+
+  // replay through the interpreter, which stays authoritative
+  cpu->_registers = jit->saved_registers_;
+  cpu->flags_op_ = jit->saved_flags_op_;
+  cpu->flags_dest_ = jit->saved_flags_dest_;
+  cpu->flags_src_ = jit->saved_flags_src_;
+  cpu->flags_carry_ = jit->saved_flags_carry_;
+  auto interpreted = InstructionTable::execute(cpu, *inst);
+
+  // F itself may be stale in either under a lazy operation
+  auto registers = cpu->_registers;
+  registers.r8[reg8_index(CPURegister::REG_F)] = cpu->flags();
+  if (clocks != interpreted ||
+      memcmp(&native, &registers, sizeof(native)) != 0) {
+    ++jit->mismatches_;
+    debug_log("JIT mismatch on opcode 0x%02x at 0x%04x, interpreter %s",
+              inst->opcode,
+              jit->saved_registers_.r16[reg16_index(CPURegister::REG_PC)],
+              cpu->debug_info().c_str());
+  }
+}
+
+CompiledBlock JitCompiler::compile(BasicBlock *block) {
+#ifdef GB_JIT_X86_64
+  if (code_ == nullptr || block->insts.empty()) {
+    return nullptr;
+  }
+  for (const auto &inst : block->insts) {
+    if (inst.cycles == 0) {
+      return nullptr; // unknown opcode, its exception can't unwind native code
+    }
+  }
+
+  auto base = reinterpret_cast<const byte *>(cpu_);
+  auto offset = [base](const void *field) {
+    return int32_t(static_cast<const byte *>(field) - base);
+  };
+  CPULayout layout = {offset(&cpu_->_registers), offset(&cpu_->flags_op_),
+                      offset(&cpu_->flags_dest_), offset(&cpu_->flags_src_),
+                      offset(&cpu_->flags_carry_)};
+  JitHelpers helpers = {
+      reinterpret_cast<const void *>(&JitCompiler::step),
+      reinterpret_cast<const void *>(&JitCompiler::materialize_flags),
+      reinterpret_cast<const void *>(&JitCompiler::save_registers),
+      reinterpret_cast<const void *>(&JitCompiler::check_registers)};
+  BlockCompiler compiler(layout, helpers, mode_ == JIT_DIFFERENTIAL);
+  const auto &code = compiler.compile(*block);
+
+  if (code.size() > code_size_) {
+    return nullptr;
+  }
+  if (code_used_ + code.size() > code_size_) {
+    debug_log("JIT code cache full, flushing %zu blocks", compiled_.size());
+    flush();
+  }
+  auto entry = code_ + code_used_;
+  if (!protect(entry, code.size(), PROT_READ | PROT_WRITE)) {
+    return nullptr;
+  }
+  memcpy(entry, code.data(), code.size());
+  if (!protect(entry, code.size(), PROT_READ | PROT_EXEC)) {
+    return nullptr;
+  }
+  code_used_ += (code.size() + 15) & ~size_t(15);
+  compiled_.push_back(block);
+  return reinterpret_cast<CompiledBlock>(entry);
+#else
+  return nullptr;
+#endif
+}
+
+} // namespace GB
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "cpu.h"
+#include "hardware.h"
+#include "instruction_cache.h"
+#include <vector>
+
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(_WIN32)
+#define GB_JIT_X86_64 1
+#endif
+
+namespace GB {
+
+enum JitMode : int {
+  JIT_OFF,
+  JIT_ON,
+  // every natively compiled instruction is replayed through the interpreter
+  // and the register files are compared
+  JIT_DIFFERENTIAL,
+};
+
+/*
+  Translates hot basic blocks into x86-64 code.
+
+  A, BC, DE, HL and SP live in callee-saved host registers while a block
+  runs (bpl, r12-r15, the high GB register in bits 8-15): they are loaded on
+  first use and only written back around calls and at the exits. Loads,
+  INC/DEC, the 8-bit ALU on registers and immediates, 16-bit INC/DEC and the
+  jumps ending a block are emitted natively. F stays lazy as in the
+  interpreter: an ALU op stores its operands to CPU::flags_*, and a
+  conditional jump tests them for the operation known at compile time.
+  Instructions touching memory (and EI, or any other last one of the block)
+  go through CPU::step_batched, so the batching rules of the interpreter are
+  kept as they are; the rest call their interpreter handler.
+
+  Only ROM code is compiled, its blocks are keyed by bank so a bank switch
+  never makes them stale. The code cache is never writable and executable at
+  the same time. Once it is full it is flushed, the blocks it held go back to
+  the interpreter until they are hot again.
+*/
+class JitCompiler final : public non_copyable {
+public:
+  JitCompiler(CPU *cpu, JitMode mode);
+  ~JitCompiler();
+
+  static bool supported();
+
+  // nullptr if the block has to stay interpreted
+  CompiledBlock compile(BasicBlock *block);
+
+  size_t mismatches() const { return mismatches_; }
+
+private:
+#ifdef GB_JIT_X86_64
+  // mprotect of the pages holding size bytes of code
+  static bool protect(byte *code, size_t size, int prot);
+#endif
+  // drops every compiled block
+  void flush();
+
+  static bool step(CPU *cpu, const DecodedInstruction *inst, int max_clocks,
+                   int *clocks);
+  static void materialize_flags(CPU *cpu);
+  static void save_registers(CPU *cpu);
+  static void check_registers(CPU *cpu, const DecodedInstruction *inst,
+                              int clocks);
+
+private:
+  CPU *cpu_;
+  JitMode mode_;
+  byte *code_;
+  size_t code_size_;
+  size_t code_used_;
+  std::vector<BasicBlock *> compiled_;
+
+  RegisterFile saved_registers_;
+  LazyFlagsOp saved_flags_op_;
+  reg8_t saved_flags_dest_;
+  reg8_t saved_flags_src_;
+  reg8_t saved_flags_carry_;
+  size_t mismatches_;
+};
+
+} // namespace GB
@@ -41,7 +41,7 @@ enum JoypadKey {
   KEY_NONE = 0xff,
 };
 
-class Joypad final : public IPortOperator {
+class Joypad final {
   enum KeyOption {
     Direction = 0,
     Button = 1,
@@ -49,7 +49,7 @@ class Joypad final : public IPortOperator {
   };
 
 public:
-  Joypad() : opt_(KeyOption::None) {
+  Joypad() : opt_(KeyOption::None), key_pressed_(false) {
     key_flags_[0] = 0xf;
     key_flags_[1] = 0xf;
   }
@@ -64,13 +64,24 @@ public:
     uint8_t flags = key_flags_[keyopt];
     if (pressed) {
       CLEAR_BIT(flags, key & 0xf);
+      key_pressed_ = true;
     } else {
       SET_BIT(flags, key & 0xf);
     }
     key_flags_[keyopt] = flags;
   }
 
-  void set_reg(a16_t addr, byte data) override {
+  // true once after a key went down, which raises the joypad interrupt
+  bool take_key_press() {
+    if (!key_pressed_) {
+      return false;
+    }
+    key_pressed_ = false;
+    return true;
+  }
+
+  // JOYP, mapped with typed accessors in the I/O table
+  void set_reg(byte data) {
     if (!IS_BIT_SET(data, JoypadKeyBit::KEY_P14)) {
       opt_ = KeyOption::Direction;
     } else if (!IS_BIT_SET(data, JoypadKeyBit::KEY_P15)) {
@@ -80,7 +91,7 @@ public:
     }
   }
 
-  byte get_reg(a16_t addr) const override {
+  byte get_reg() const {
     byte data = 0;
     if (opt_ == KeyOption::Direction) {
       SET_BIT(data, JoypadKeyBit::KEY_P14);
@@ -95,6 +106,7 @@ public:
 private:
   KeyOption opt_;
   volatile byte key_flags_[2];
+  volatile bool key_pressed_;
 }; // namespace GB
 
 } // namespace GB
\ No newline at end of file
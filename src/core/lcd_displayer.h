@@ -2,7 +2,7 @@
 
 #include "hardware.h"
 #include "joypad.h"
-#include "pixelmap.h"
+#include "gpu.h"
 #include <GLFW/glfw3.h>
 #include <atomic>
 #include <list>
@@ -16,7 +16,9 @@ class LCDDisplayer{
 public:
   virtual ~LCDDisplayer() = default;
   virtual bool prepare(Joypad *joypad) = 0;
-  virtual void push_frame(const PixelMap &frame) = 0;
+  virtual void push_frame(const ScreenFrame &frame) = 0;
+  // in place of push_frame() when the frame is the same as the last pushed
+  virtual void repeat_frame() = 0;
   virtual void run() = 0;
 };
 
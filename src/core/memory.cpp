@@ -1,15 +1,90 @@
 #include "memory.h"
+#include "instruction_cache.h"
 #include <cstring>
 
 namespace GB {
 Memory::Memory()
-    : gpu_(nullptr), oam_(nullptr), cartridge_(nullptr), boot_rom_(nullptr) {
+    : gpu_(nullptr), oam_(nullptr), cartridge_(nullptr), bank_generation_(0),
+      boot_rom_(nullptr), code_cache_(nullptr) {
   memset(_memory, 0, sizeof(_memory));
-  memset(ioport_handlers, 0, sizeof(ioport_handlers));
+  memset(read_pages_, 0, sizeof(read_pages_));
+  memset(write_pages_, 0, sizeof(write_pages_));
+  // unmapped registers and HRAM are plain memory, HRAM writes have to reach
+  // the code cache though
+  for (size_t i = 0; i < MAX_IO_PORT_NUM; ++i) {
+    auto data = &_memory[0xFF00 + i];
+    ports_[i] = {nullptr, nullptr, nullptr, data, data};
+    if (i >= 0x80 && i < 0xFF) {
+      ports_[i] = {nullptr, &Memory::set_hram, this, data, nullptr};
+    }
+  }
+  // WRAM and its echo
+  for (size_t page = 0xC0; page < 0xFE; ++page) {
+    auto ram = &_memory[(page < 0xE0 ? page : page - 0x20) << 8];
+    read_pages_[page] = ram;
+    write_pages_[page] = ram;
+  }
 }
 Memory::~Memory() {}
 
-byte Memory::get(a16_t addr) const {
+bool Memory::place_port(a16_t addr, const IOPort &port) {
+  assert(addr >= 0xFF00);
+  auto &entry = ports_[addr - 0xFF00];
+  if (entry.owner != nullptr || entry.read != &_memory[addr]) {
+    return false;
+  }
+  entry = port;
+  return true;
+}
+
+void Memory::set_hram(void *owner, a16_t addr, byte data) {
+  auto memory = static_cast<Memory *>(owner);
+  if (memory->code_cache_ != nullptr) {
+    memory->code_cache_->invalidate(addr);
+  }
+  memory->_memory[addr] = data;
+}
+
+void Memory::map_pages(size_t begin, size_t end, MemoryOperator *opr) {
+  for (auto addr = begin; addr < end; addr += 0x100) {
+    read_pages_[addr >> 8] = opr ? opr->read_page(addr) : nullptr;
+    write_pages_[addr >> 8] = opr ? opr->write_page(addr) : nullptr;
+  }
+}
+
+void Memory::map_cartridge() {
+  map_pages(0x0000, 0x4000, cartridge_);
+  if (boot_rom_ != nullptr) {
+    map_pages(0x0000, 0x0100, boot_rom_);
+  }
+  if (cartridge_ != nullptr) {
+    map_banks();
+  } else {
+    map_pages(0x4000, 0x8000, nullptr);
+    map_pages(0xA000, 0xC000, nullptr);
+  }
+}
+
+void Memory::map_banks() {
+  const auto &banks = cartridge_->banks();
+  bank_generation_ = cartridge_->bank_generation();
+  for (size_t page = 0; page < 0x40; ++page) {
+    read_pages_[0x40 + page] = banks.rom + (page << 8);
+    write_pages_[0x40 + page] = nullptr;
+  }
+  for (size_t page = 0; page < 0x20; ++page) {
+    auto mapped = (page << 8) < banks.ram_size;
+    read_pages_[0xA0 + page] =
+        mapped && banks.ram_read ? banks.ram_read + (page << 8) : nullptr;
+    write_pages_[0xA0 + page] =
+        mapped && banks.ram_write ? banks.ram_write + (page << 8) : nullptr;
+  }
+}
+
+byte Memory::get_slow(a16_t addr) const {
+  if (addr >= 0xFF00) {
+    return get_port(addr);
+  }
   if (addr < 0x100 && boot_rom_ != nullptr) {
     return boot_rom_->get(addr);
   }
@@ -23,22 +98,25 @@ byte Memory::get(a16_t addr) const {
     addr -= 0x2000; // echo
   } else if (addr >= 0xFE00 && addr < 0xFEA0) {
     return oam_->get(addr);
-  } else if (addr >= 0xFF00) {
-    auto opr = get_ioport_handle(addr);
-    if (opr != nullptr) {
-      return opr->get_reg(addr);
-    }
   }
   return _memory[addr];
 }
 
-void Memory::set(a16_t addr, byte data) {
+void Memory::set_slow(a16_t addr, byte data) {
+  if (addr >= 0xFF00) {
+    set_port(addr, data);
+    return;
+  }
   if (addr < 0x100 && boot_rom_ != nullptr) {
     boot_rom_->set(addr, data);
     return;
   }
   if (addr < 0x8000) {
+    // MBC control, which may switch banks
     cartridge_->set(addr, data);
+    if (cartridge_->bank_generation() != bank_generation_) {
+      map_banks();
+    }
     return;
   } else if (addr < 0xa000) {
     gpu_->set(addr, data);
@@ -51,14 +129,11 @@ void Memory::set(a16_t addr, byte data) {
   } else if (addr >= 0xFE00 && addr < 0xFEA0) {
     oam_->set(addr, data);
     return;
-  } else if (addr >= 0xFF00) {
-    auto opr = get_ioport_handle(addr);
-    if (opr != nullptr) {
-      opr->set_reg(addr, data);
-      return;
-    }
+  }
+  if (code_cache_ != nullptr) {
+    code_cache_->invalidate(addr);
   }
   _memory[addr] = data;
 }
 
-} // namespace GB
\ No newline at end of file
+} // namespace GB
@@ -1,12 +1,15 @@
 #pragma once
 
+#include "cartridge.h"
 #include "hardware.h"
 #include "memory_operator.h"
+#include <algorithm>
 #include <map>
 
 #include <cassert>
 
 namespace GB {
+class InstructionCache;
 
 /*
 General Memory Map
@@ -22,50 +25,146 @@ General Memory Map
   FF00-FF7F   I/O Ports
   FF80-FFFE   High RAM (HRAM)
   FFFF        Interrupt Enable Register
+
+  Every 256 bytes page has a host pointer for reading and one for writing, so
+  that most accesses are a single indexed load or store. A page whose
+  accesses have side effects (MBC control, I/O, OAM, WRAM holding cached
+  code, ...) has a nullptr entry and goes through the range checks and the
+  operators instead. Bank switches and unloading the boot ROM only repoint
+  page entries.
+
+  The FF page is a table of its own with an entry per register (see IOPort),
+  filled in as the components connect.
 */
 
 constexpr size_t MEMORY_ROOM = 0x10000;
 constexpr size_t MAX_IO_PORT_NUM = 0x100;
+constexpr size_t MEMORY_PAGE_NUM = 0x100;
 
 class Memory final : public non_copyable {
 public:
   Memory();
   ~Memory();
 
-  byte get(a16_t addr) const;
-  void set(a16_t addr, byte data);
+  byte get(a16_t addr) const {
+    auto page = read_pages_[addr >> 8];
+    return page != nullptr ? page[addr & 0xff] : get_slow(addr);
+  }
+  void set(a16_t addr, byte data) {
+    auto page = write_pages_[addr >> 8];
+    if (page != nullptr) {
+      page[addr & 0xff] = data;
+      return;
+    }
+    set_slow(addr, data);
+  }
 
-  void connect_gpu(MemoryOperator *opr) { gpu_ = opr; }
+  void connect_gpu(MemoryOperator *opr) {
+    gpu_ = opr;
+    map_pages(0x8000, 0xA000, gpu_);
+  }
   void connect_oam(MemoryOperator *opr) { oam_ = opr; }
-  void load_cartridge(MemoryOperator *opr) { cartridge_ = opr; }
-  void load_boot_rom(MemoryOperator *opr) { boot_rom_ = opr; }
-  void unload_boot_rom() { boot_rom_ = nullptr; }
+  void connect_code_cache(InstructionCache *cache) { code_cache_ = cache; }
+  void load_cartridge(Cartridge *cartridge) {
+    cartridge_ = cartridge;
+    map_cartridge();
+  }
+  void load_boot_rom(MemoryOperator *opr) {
+    boot_rom_ = opr;
+    map_cartridge();
+  }
+  void unload_boot_rom() {
+    boot_rom_ = nullptr;
+    map_cartridge();
+  }
+  bool boot_rom_loaded() const { return boot_rom_ != nullptr; }
 
-  IPortOperator *get_ioport_handle(a16_t addr) const {
-    assert(addr >= 0xFF00);
-    return ioport_handlers[addr - 0xFF00];
+  // the ROM bank currently mapped at 4000-7FFF
+  size_t rom_bank() const { return cartridge_->rom_bank(); }
+
+  // code got cached from the WRAM page (C0-DF): writes to it and its echo
+  // have to go through set_slow, which invalidates the cache, until
+  // unwatch_writes says the last of that code is gone
+  void watch_writes(size_t page) { map_wram_page(page, nullptr); }
+  void unwatch_writes(size_t page) {
+    map_wram_page(page, &_memory[page << 8]);
   }
 
-  bool map_port(a16_t addr, IPortOperator *opr) {
-    assert(addr >= 0xFF00);
-    addr -= 0xFF00;
-    if (ioport_handlers[addr] != nullptr) {
-      return false;
+  byte get_port(a16_t addr) const {
+    const auto &port = ports_[addr & 0xff];
+    return port.read != nullptr ? *port.read : port.get(port.owner, addr);
+  }
+  void set_port(a16_t addr, byte data) {
+    const auto &port = ports_[addr & 0xff];
+    if (port.set != nullptr) {
+      port.set(port.owner, addr, data);
+    } else if (port.write != nullptr) {
+      *port.write = data;
     }
-    ioport_handlers[addr] = opr;
-    return true;
+  }
+
+  // each map_port fails if the register is mapped already
+  //
+  // a register without side effects, kept in data
+  bool map_port(a16_t addr, byte *data) {
+    return place_port(addr, {nullptr, nullptr, nullptr, data, data});
+  }
+  // a register read straight from data, Set takes the writes
+  template <class T, void (T::*Set)(byte)>
+  bool map_port(a16_t addr, T *owner, const byte *data) {
+    return place_port(addr,
+                      {nullptr, &port_set<T, Set>, owner, data, nullptr});
+  }
+  // a register with accessors on both sides
+  template <class T, byte (T::*Get)() const, void (T::*Set)(byte)>
+  bool map_port(a16_t addr, T *owner) {
+    return place_port(addr, {&port_get<T, Get>, &port_set<T, Set>, owner,
+                             nullptr, nullptr});
+  }
+  // a register served by the virtual get_reg/set_reg
+  bool map_port(a16_t addr, IPortOperator *opr) {
+    return place_port(addr, {&virtual_port_get, &virtual_port_set, opr,
+                             nullptr, nullptr});
   }
 
 private:
-  void set_dma(d8_t v);
+  byte get_slow(a16_t addr) const;
+  void set_slow(a16_t addr, byte data);
+
+  bool place_port(a16_t addr, const IOPort &port);
+  static byte virtual_port_get(void *owner, a16_t addr) {
+    return static_cast<const IPortOperator *>(owner)->get_reg(addr);
+  }
+  static void virtual_port_set(void *owner, a16_t addr, byte data) {
+    static_cast<IPortOperator *>(owner)->set_reg(addr, data);
+  }
+  static void set_hram(void *owner, a16_t addr, byte data);
+
+  // points the pages of [begin, end) at what opr exposes, nullptr unmaps them
+  void map_pages(size_t begin, size_t end, MemoryOperator *opr);
+  void map_cartridge();
+  void map_wram_page(size_t page, byte *ram) {
+    assert(page >= 0xC0 && page < 0xE0);
+    write_pages_[page] = ram;
+    if (page + 0x20 < 0xFE) {
+      write_pages_[page + 0x20] = ram;
+    }
+  }
+  // 4000-7FFF and A000-BFFF from the cartridge's current banks
+  void map_banks();
 
 private:
   byte _memory[MEMORY_ROOM];
-  IPortOperator *ioport_handlers[MAX_IO_PORT_NUM];
+  const byte *read_pages_[MEMORY_PAGE_NUM];
+  byte *write_pages_[MEMORY_PAGE_NUM];
+  // FF00-FFFF: the I/O registers, HRAM and IE
+  IOPort ports_[MAX_IO_PORT_NUM];
   MemoryOperator *gpu_;
   MemoryOperator *oam_;
-  MemoryOperator *cartridge_;
+  Cartridge *cartridge_;
+  uint32_t bank_generation_; // of the banks mapped
   MemoryOperator *boot_rom_;
+  InstructionCache *code_cache_;
 };
 
-} // namespace GB
\ No newline at end of file
+} // namespace GB
@@ -6,6 +6,8 @@ namespace GB {
 
 enum MappedIOPorts {
   REG_JOYPAD = 0xFF00,
+  REG_SB = 0xFF01,
+  REG_SC = 0xFF02,
   REG_IF = 0XFF0F,
   REG_DIV = 0XFF04,
   REG_TIMA = 0XFF05,
@@ -36,11 +38,42 @@ public:
   virtual byte get_reg(a16_t addr) const = 0;
 };
 
+/*
+  One entry of the I/O register table. A read loads *read, or calls get when
+  read is nullptr; a write calls set, or stores to *write when set is
+  nullptr (and is dropped when both are).
+*/
+struct IOPort {
+  byte (*get)(void *owner, a16_t addr);
+  void (*set)(void *owner, a16_t addr, byte data);
+  void *owner;
+  const byte *read;
+  byte *write;
+};
+
+// trampolines from the table to the register accessors of a component,
+// resolved at compile time so the accessor can be inlined into them
+template <class T, byte (T::*Get)() const>
+byte port_get(void *owner, a16_t addr) {
+  return (static_cast<const T *>(owner)->*Get)();
+}
+
+template <class T, void (T::*Set)(byte)>
+void port_set(void *owner, a16_t addr, byte data) {
+  (static_cast<T *>(owner)->*Set)(data);
+}
+
 class MemoryOperator {
 public:
   virtual ~MemoryOperator() = default;
   virtual void set(a16_t addr, byte data) = 0;
   virtual byte get(a16_t addr) const = 0;
+
+  // the host memory behind the 256 bytes page starting at addr, when reading
+  // (writing) it has no side effect. nullptr sends every access of the page
+  // through get (set)
+  virtual const byte *read_page(a16_t addr) const { return nullptr; }
+  virtual byte *write_page(a16_t addr) { return nullptr; }
 };
 
 } // namespace GB
@@ -0,0 +1,164 @@
+#include "pixel_ops.h"
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define GB_PIXEL_OPS_X86_64
+#include <immintrin.h>
+#endif
+
+namespace GB {
+namespace {
+
+// bit 7 - i of b to bit 0 of byte i, byte 0 being the lowest; masked by the
+// reversed constant bit i goes to byte i instead
+constexpr uint64_t SPREAD_MASK = 0x0102040810204080ull;
+constexpr uint64_t SPREAD_MASK_FLIPPED = 0x8040201008040201ull;
+
+uint64_t spread(byte b, uint64_t mask) {
+  auto x = (b * 0x0101010101010101ull) & mask;
+  return ((x + 0x7f7f7f7f7f7f7f7full) >> 7) & 0x0101010101010101ull;
+}
+
+void store_row(uint64_t v, pixel_t *row) {
+  for (auto i = 0; i < 8; ++i) {
+    row[i] = (v >> (i * 8)) & 0xff;
+  }
+}
+
+void decode_row_scalar(byte lo, byte hi, pixel_t *row, pixel_t *flipped) {
+  store_row(spread(lo, SPREAD_MASK) | spread(hi, SPREAD_MASK) << 1, row);
+  store_row(spread(lo, SPREAD_MASK_FLIPPED) |
+                spread(hi, SPREAD_MASK_FLIPPED) << 1,
+            flipped);
+}
+
+void map_palette_scalar(const pixel_t *colors, pixel_t *shades, size_t n,
+                        uint8_t palette) {
+  const pixel_t lut[4] = {pixel_t(palette & 0x3), pixel_t(palette >> 2 & 0x3),
+                          pixel_t(palette >> 4 & 0x3),
+                          pixel_t(palette >> 6 & 0x3)};
+  for (size_t i = 0; i < n; ++i) {
+    shades[i] = lut[colors[i]];
+  }
+}
+
+#ifdef GB_PIXEL_OPS_X86_64
+// both orientations in one register, the row in the low half: each byte
+// tests its bit of the plane and keeps 1 (2) when it is set
+void decode_row_sse2(byte lo, byte hi, pixel_t *row, pixel_t *flipped) {
+  auto bits = _mm_setr_epi8(char(0x80), 0x40, 0x20, 0x10, 0x08, 0x04, 0x02,
+                            0x01, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40,
+                            char(0x80));
+  auto l = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(char(lo)), bits), bits);
+  auto h = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(char(hi)), bits), bits);
+  auto v = _mm_or_si128(_mm_and_si128(l, _mm_set1_epi8(1)),
+                        _mm_and_si128(h, _mm_set1_epi8(2)));
+  _mm_storel_epi64(reinterpret_cast<__m128i *>(row), v);
+  _mm_storel_epi64(reinterpret_cast<__m128i *>(flipped),
+                   _mm_unpackhi_epi64(v, v));
+}
+
+// pdep puts bit i in byte i, which is the flipped row; the byte swap of it is
+// the row (pdep is microcoded on AMD before Zen 3, still no worse than a
+// table lookup per pixel)
+__attribute__((target("bmi2"))) void
+decode_row_bmi2(byte lo, byte hi, pixel_t *row, pixel_t *flipped) {
+  uint64_t f = _pdep_u64(lo, 0x0101010101010101ull) |
+               _pdep_u64(hi, 0x0202020202020202ull);
+  uint64_t r = __builtin_bswap64(f);
+  memcpy(flipped, &f, sizeof(f));
+  memcpy(row, &r, sizeof(r));
+}
+
+// one compare per shade
+void map_palette_sse2(const pixel_t *colors, pixel_t *shades, size_t n,
+                      uint8_t palette) {
+  __m128i shade[4];
+  for (auto c = 0; c < 4; ++c) {
+    shade[c] = _mm_set1_epi8(palette >> (c * 2) & 0x3);
+  }
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(colors + i));
+    auto out = _mm_setzero_si128();
+    for (auto c = 0; c < 4; ++c) {
+      auto hit = _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+      out = _mm_or_si128(out, _mm_and_si128(hit, shade[c]));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(shades + i), out);
+  }
+  map_palette_scalar(colors + i, shades + i, n - i, palette);
+}
+
+// the palette is a 4-entry table for pshufb
+__attribute__((target("ssse3"))) void
+map_palette_ssse3(const pixel_t *colors, pixel_t *shades, size_t n,
+                  uint8_t palette) {
+  auto lut = _mm_setr_epi8(palette & 0x3, palette >> 2 & 0x3,
+                           palette >> 4 & 0x3, palette >> 6 & 0x3, 0, 0, 0, 0,
+                           0, 0, 0, 0, 0, 0, 0, 0);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(colors + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(shades + i),
+                     _mm_shuffle_epi8(lut, v));
+  }
+  map_palette_scalar(colors + i, shades + i, n - i, palette);
+}
+
+// vpshufb looks up within each 128-bit lane, so both get the table
+__attribute__((target("avx2"))) void
+map_palette_avx2(const pixel_t *colors, pixel_t *shades, size_t n,
+                 uint8_t palette) {
+  auto lut = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      palette & 0x3, palette >> 2 & 0x3, palette >> 4 & 0x3,
+      palette >> 6 & 0x3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(colors + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(shades + i),
+                        _mm256_shuffle_epi8(lut, v));
+  }
+  map_palette_ssse3(colors + i, shades + i, n - i, palette);
+}
+#endif
+
+// from the plainest to the fastest. pshufb has nothing to look up in two
+// bitplane bytes, SSSE3 decodes rows like SSE2
+const PixelOps PIXEL_OPS[] = {
+    {decode_row_scalar, map_palette_scalar, "scalar"},
+#ifdef GB_PIXEL_OPS_X86_64
+    {decode_row_sse2, map_palette_sse2, "sse2"},
+    {decode_row_sse2, map_palette_ssse3, "ssse3"},
+    {decode_row_bmi2, map_palette_avx2, "avx2+bmi2"},
+#endif
+};
+
+size_t supported_count() {
+#ifdef GB_PIXEL_OPS_X86_64
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+    return 4;
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    return 3;
+  }
+  return 2;
+#else
+  return 1;
+#endif
+}
+
+} // namespace
+
+const PixelOps *supported_pixel_ops(size_t *count) {
+  *count = supported_count();
+  return PIXEL_OPS;
+}
+
+const PixelOps &pixel_ops() {
+  static const PixelOps &ops = PIXEL_OPS[supported_count() - 1];
+  return ops;
+}
+
+} // namespace GB
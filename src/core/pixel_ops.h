@@ -0,0 +1,29 @@
+#pragma once
+
+#include "hardware.h"
+#include "pixelmap.h"
+
+namespace GB {
+
+/*
+  The per-pixel kernels of the renderer. Each has a plain version and, on
+  x86-64 with GCC or Clang, vector ones; pixel_ops() picks the best the host
+  CPU runs the first time it is called. The benchmark under src/bench checks
+  every version the host runs against the plain one.
+*/
+struct PixelOps {
+  // the colour numbers of a tile row from its two bitplanes, left to right
+  // and right to left
+  void (*decode_row)(byte lo, byte hi, pixel_t *row, pixel_t *flipped);
+  // maps n colour numbers to shades through a BGP/OBP style palette, colors
+  // and shades may be the same
+  void (*map_palette)(const pixel_t *colors, pixel_t *shades, size_t n,
+                      uint8_t palette);
+  const char *name;
+};
+
+const PixelOps &pixel_ops();
+// every version the host CPU runs, from the plain one to the fastest
+const PixelOps *supported_pixel_ops(size_t *count);
+
+} // namespace GB
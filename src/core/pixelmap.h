@@ -39,6 +39,11 @@ public:
     return pixels_[y * width_ + x];
   }
 
+  pixel_t *row(size_t y) {
+    assert(y < height_);
+    return &pixels_[y * width_];
+  }
+
   PixelMap cut(size_t x, size_t y, size_t width, size_t height) const;
   PixelMap magnify(size_t ratio) const;
 
@@ -0,0 +1,118 @@
+#include "rom_image.h"
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+namespace GB {
+
+namespace {
+
+// the cartridge header, 0100-014F
+constexpr size_t HEADER_BEGIN = 0x100;
+constexpr size_t HEADER_END = 0x150;
+
+// size, global checksum and a hash of the header. Only an index: hacks and
+// homebrew often keep the header and leave the checksum unfixed, so images
+// with the same key are compared in full before one is shared
+typedef std::tuple<size_t, uint16_t, uint64_t> ROMKey;
+
+ROMKey rom_key(const byte *data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a
+  for (auto i = HEADER_BEGIN; i < HEADER_END; ++i) {
+    hash = (hash ^ data[i]) * 0x100000001b3ull;
+  }
+  uint16_t global_checksum = data[0x14e] << 8 | data[0x14f];
+  return ROMKey(size, global_checksum, hash);
+}
+
+size_t padded_size(size_t size) {
+  size = (size + ROM_BANK_SIZE - 1) & ~(ROM_BANK_SIZE - 1);
+  return size < 2 * ROM_BANK_SIZE ? 2 * ROM_BANK_SIZE : size;
+}
+
+std::mutex registry_mutex;
+std::map<ROMKey, std::weak_ptr<const ROMImage>> registry;
+
+} // namespace
+
+#ifndef _WIN32
+ROMImage::~ROMImage() { munmap(const_cast<byte *>(data_), size_); }
+
+ROMImagePtr ROMImage::load(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return ROMImagePtr();
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < HEADER_END) {
+    close(fd);
+    return ROMImagePtr();
+  }
+  size_t size = st.st_size;
+  size_t padded = padded_size(size);
+  // zero pages for the padding, with the file mapped over their head. The
+  // mapping stays valid once the descriptor is gone
+  void *data =
+      mmap(nullptr, padded, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return ROMImagePtr();
+  }
+  auto file = mmap(data, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    munmap(data, padded);
+    return ROMImagePtr();
+  }
+  ROMImagePtr image(new ROMImage(static_cast<const byte *>(data), padded));
+#else
+ROMImage::~ROMImage() { delete[] data_; }
+
+ROMImagePtr ROMImage::load(const std::string &path) {
+  std::ifstream is(path.c_str(), std::ifstream::binary);
+  if (!is) {
+    return ROMImagePtr();
+  }
+  is.seekg(0, is.end);
+  size_t size = is.tellg();
+  is.seekg(0, is.beg);
+  if (size < HEADER_END) {
+    return ROMImagePtr();
+  }
+  size_t padded = padded_size(size);
+  auto data = new byte[padded]();
+  is.read(reinterpret_cast<char *>(data), size);
+  ROMImagePtr image(new ROMImage(data, padded));
+#endif
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  // drop the entries of images nobody holds any more
+  for (auto i = registry.begin(); i != registry.end();) {
+    i = i->second.expired() ? registry.erase(i) : std::next(i);
+  }
+  auto &entry = registry[rom_key(image->data(), size)];
+  auto shared = entry.lock();
+  if (!shared) {
+    entry = image;
+    return image;
+  }
+  if (shared->size() == image->size() &&
+      memcmp(shared->data(), image->data(), image->size()) == 0) {
+    return shared; // drop the new mapping for the one already in use
+  }
+  // a different ROM under the same key goes unshared
+  return image;
+}
+
+} // namespace GB
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "hardware.h"
+#include <memory>
+#include <string>
+
+namespace GB {
+
+constexpr size_t ROM_BANK_SIZE = 0x4000;
+
+class ROMImage;
+typedef std::shared_ptr<const ROMImage> ROMImagePtr;
+
+/*
+  A ROM file mapped read-only into memory, nothing is copied out of it. The
+  image is padded with zeros to whole 16KB banks, two at least, so a bank
+  pointer never runs off the end of it.
+
+  Images are content-addressed: loading a ROM whose contents match an image
+  still alive hands back that image, so every VM running the same title
+  shares one mapping.
+*/
+class ROMImage final : public non_copyable {
+public:
+  ~ROMImage();
+
+  static ROMImagePtr load(const std::string &path);
+
+  const byte *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  ROMImage(const byte *data, size_t size) : data_(data), size_(size) {}
+
+  const byte *data_;
+  size_t size_;
+};
+
+} // namespace GB
@@ -0,0 +1,109 @@
+#include "rtc.h"
+#include "cpu.h"
+#include "scheduler.h"
+#include <cstring>
+#include <ctime>
+
+namespace GB {
+
+constexpr byte RTC_REG_MASKS[RTC_REG_NUM] = {0x3f, 0x3f, 0x1f, 0xff, 0xc1};
+
+RTC::RTC()
+    : scheduler_(nullptr), last_sync_(0), sub_clocks_(0), sync_host_(false),
+      host_time_(0) {
+  memset(regs_, 0, sizeof(regs_));
+  memset(latched_, 0, sizeof(latched_));
+}
+
+void RTC::connect(const Scheduler *scheduler) {
+  sync();
+  scheduler_ = scheduler;
+  last_sync_ = scheduler_ ? scheduler_->now() : 0;
+}
+
+void RTC::set(int reg, byte data) {
+  sync();
+  // writing the seconds restarts the second
+  if (reg == RTC_S) {
+    sub_clocks_ = 0;
+  }
+  regs_[reg] = data & RTC_REG_MASKS[reg];
+}
+
+void RTC::latch() {
+  sync();
+  memcpy(latched_, regs_, sizeof(regs_));
+}
+
+void RTC::sync() {
+  if (scheduler_ == nullptr) {
+    return;
+  }
+  auto now = scheduler_->now();
+  auto elapsed = now - last_sync_;
+  last_sync_ = now;
+  if (halted()) {
+    return;
+  }
+  auto clocks = sub_clocks_ + elapsed;
+  sub_clocks_ = clocks % NORMAL_CLOCK_FREQUENCY;
+  advance(clocks / NORMAL_CLOCK_FREQUENCY);
+}
+
+void RTC::advance(uint64_t seconds) {
+  if (seconds == 0) {
+    return;
+  }
+  uint64_t days = regs_[RTC_DL] | (regs_[RTC_DH] & 0x1) << 8;
+  uint64_t total =
+      regs_[RTC_S] + 60 * (regs_[RTC_M] + 60 * (regs_[RTC_H] + 24 * days));
+  total += seconds;
+
+  regs_[RTC_S] = total % 60;
+  total /= 60;
+  regs_[RTC_M] = total % 60;
+  total /= 60;
+  regs_[RTC_H] = total % 24;
+  days = total / 24;
+  // the carry stays set until it is written off
+  if (days > 0x1ff) {
+    regs_[RTC_DH] |= 0x80;
+  }
+  regs_[RTC_DL] = days & 0xff;
+  regs_[RTC_DH] = (regs_[RTC_DH] & 0xfe) | ((days >> 8) & 0x1);
+}
+
+void RTC::save(byte *state) {
+  sync();
+  memset(state, 0, RTC_STATE_SIZE);
+  for (int i = 0; i < RTC_REG_NUM; ++i) {
+    state[i * 4] = regs_[i];
+    state[(RTC_REG_NUM + i) * 4] = latched_[i];
+  }
+  // the host clock would make replays of the same input save differently
+  uint64_t host_time = sync_host_ ? std::time(nullptr) : host_time_;
+  for (int i = 0; i < 8; ++i) {
+    state[40 + i] = (host_time >> (i * 8)) & 0xff;
+  }
+}
+
+void RTC::load(const byte *state, bool sync_host) {
+  for (int i = 0; i < RTC_REG_NUM; ++i) {
+    regs_[i] = state[i * 4] & RTC_REG_MASKS[i];
+    latched_[i] = state[(RTC_REG_NUM + i) * 4] & RTC_REG_MASKS[i];
+  }
+  sub_clocks_ = 0;
+
+  uint64_t saved_time = 0;
+  for (int i = 0; i < 8; ++i) {
+    saved_time |= uint64_t(state[40 + i]) << (i * 8);
+  }
+  sync_host_ = sync_host;
+  host_time_ = saved_time;
+  uint64_t host_time = std::time(nullptr);
+  if (sync_host && saved_time != 0 && host_time > saved_time && !halted()) {
+    advance(host_time - saved_time);
+  }
+}
+
+} // namespace GB
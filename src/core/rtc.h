@@ -0,0 +1,69 @@
+#pragma once
+
+#include "hardware.h"
+
+namespace GB {
+
+class Scheduler;
+
+/*
+  MBC3 clock registers, selected with 08-0C in place of a RAM bank:
+  seconds, minutes, hours, the low 8 bits of the day counter and
+  bit 0 - bit 8 of the day counter
+  bit 6 - halt
+  bit 7 - day counter carry
+*/
+enum RTCRegisters {
+  RTC_S = 0,
+  RTC_M,
+  RTC_H,
+  RTC_DL,
+  RTC_DH,
+  RTC_REG_NUM,
+};
+
+// the live and the latched registers as 32-bit words then the host time in
+// seconds as a 64-bit one, all little-endian, which is what .sav files of
+// other emulators carry after the RAM too. The host time is only stamped when
+// the clock syncs with the host, otherwise the loaded one is written back
+constexpr size_t RTC_STATE_SIZE = 48;
+
+/*
+  The clock counts emulated clocks, not host time, so it keeps pace with the
+  game at any emulation speed and a replay sees the same time every run. Like
+  the timer it is brought up to date from the scheduler clock whenever it is
+  touched, there is nothing to do while it isn't.
+*/
+class RTC final : public non_copyable {
+public:
+  RTC();
+
+  // counts the scheduler's clocks from now on, nullptr stops it
+  void connect(const Scheduler *scheduler);
+
+  // reads see the registers as of the last latch
+  byte get(int reg) const { return latched_[reg]; }
+  void set(int reg, byte data);
+  void latch();
+
+  void save(byte *state);
+  // with sync_host the time spent between the save and now is added, and
+  // later saves stamp the host time
+  void load(const byte *state, bool sync_host);
+
+private:
+  bool halted() const { return (regs_[RTC_DH] & 0x40) != 0; }
+  void sync();
+  void advance(uint64_t seconds);
+
+private:
+  const Scheduler *scheduler_;
+  uint64_t last_sync_;
+  uint32_t sub_clocks_; // clocks into the current second
+  bool sync_host_;
+  uint64_t host_time_; // as saved, when not synced with the host
+  byte regs_[RTC_REG_NUM];
+  byte latched_[RTC_REG_NUM];
+};
+
+} // namespace GB
@@ -0,0 +1,167 @@
+#include "save_ram.h"
+#include "common.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace GB {
+
+SaveRAM::SaveRAM(size_t size)
+    : data_(new byte[size]()), size_(size), trailer_size_(0), mapped_(false),
+      dirty_words_((size / SAVE_RAM_BLOCK_SIZE + 63) / 64 + 1),
+      flush_interval_(0), stopping_(false) {
+  dirty_.reset(new std::atomic<uint64_t>[dirty_words_]());
+}
+
+SaveRAM::SaveRAM(size_t size, const std::string &path, int flush_interval,
+                 size_t trailer)
+    : data_(nullptr), size_(size), trailer_size_(trailer), path_(path),
+      mapped_(false),
+      dirty_words_((bytes() / SAVE_RAM_BLOCK_SIZE + 63) / 64 + 1),
+      flush_interval_(flush_interval), stopping_(false) {
+  dirty_.reset(new std::atomic<uint64_t>[dirty_words_]());
+  if (!map_file()) {
+    debug_log("can't map %s, saving on exit only", path_.c_str());
+    data_ = new byte[bytes()]();
+    load_file();
+    return;
+  }
+  if (flush_interval_ > 0) {
+    flusher_ = std::thread(&SaveRAM::flush_loop, this);
+  }
+}
+
+SaveRAM::~SaveRAM() {
+  if (flusher_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(flusher_mutex_);
+      stopping_ = true;
+    }
+    flusher_cv_.notify_one();
+    flusher_.join();
+  }
+  flush();
+#ifndef _WIN32
+  if (mapped_) {
+    munmap(data_, bytes());
+    return;
+  }
+#endif
+  delete[] data_;
+}
+
+#ifndef _WIN32
+bool SaveRAM::map_file() {
+  int fd = open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  // a new or short file is grown with zeros
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t(st.st_size) < bytes() && ftruncate(fd, bytes()) != 0)) {
+    close(fd);
+    return false;
+  }
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  // fault it all in now rather than in the middle of a frame
+  flags |= MAP_POPULATE;
+#endif
+  void *data = mmap(nullptr, bytes(), PROT_READ | PROT_WRITE, flags, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  data_ = static_cast<byte *>(data);
+  mapped_ = true;
+  return true;
+}
+#else
+bool SaveRAM::map_file() { return false; }
+#endif
+
+void SaveRAM::load_file() {
+  std::ifstream is(path_.c_str(), std::ifstream::binary);
+  if (is) {
+    is.read(reinterpret_cast<char *>(data_), bytes());
+  }
+}
+
+void SaveRAM::flush() {
+  if (!battery()) {
+    return;
+  }
+  std::vector<uint64_t> dirty(dirty_words_);
+  bool any = false;
+  for (size_t i = 0; i < dirty_words_; ++i) {
+    dirty[i] = dirty_[i].exchange(0, std::memory_order_relaxed);
+    any = any || dirty[i];
+  }
+  if (!any) {
+    return;
+  }
+
+  std::fstream os;
+  if (!mapped_) {
+    os.open(path_.c_str(), std::fstream::in | std::fstream::out |
+                               std::fstream::binary);
+    if (!os) {
+      os.open(path_.c_str(), std::fstream::out | std::fstream::binary);
+    }
+    if (!os) {
+      debug_log("can't write %s", path_.c_str());
+      return;
+    }
+  }
+
+  // neighbouring dirty blocks go out as one range
+  auto write_back = [&](size_t begin, size_t end) {
+    end = std::min(end, bytes());
+#ifndef _WIN32
+    if (mapped_) {
+      size_t page = sysconf(_SC_PAGESIZE);
+      auto aligned = begin & ~(page - 1);
+      msync(data_ + aligned, end - aligned, MS_SYNC);
+      return;
+    }
+#endif
+    os.seekp(begin);
+    os.write(reinterpret_cast<const char *>(data_ + begin), end - begin);
+  };
+
+  size_t blocks = (bytes() + SAVE_RAM_BLOCK_SIZE - 1) / SAVE_RAM_BLOCK_SIZE;
+  size_t run = blocks;
+  for (size_t block = 0; block <= blocks; ++block) {
+    bool is_dirty =
+        block < blocks && (dirty[block / 64] >> (block % 64) & 0x1) != 0;
+    if (is_dirty && run == blocks) {
+      run = block;
+    } else if (!is_dirty && run != blocks) {
+      write_back(run * SAVE_RAM_BLOCK_SIZE, block * SAVE_RAM_BLOCK_SIZE);
+      run = blocks;
+    }
+  }
+}
+
+void SaveRAM::flush_loop() {
+  std::unique_lock<std::mutex> lock(flusher_mutex_);
+  while (!stopping_) {
+    flusher_cv_.wait_for(lock, std::chrono::milliseconds(flush_interval_));
+    if (stopping_) {
+      break;
+    }
+    lock.unlock();
+    flush();
+    lock.lock();
+  }
+}
+
+} // namespace GB
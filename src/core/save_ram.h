@@ -0,0 +1,76 @@
+#pragma once
+
+#include "hardware.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace GB {
+
+constexpr size_t SAVE_RAM_BLOCK_SIZE = 0x200;
+constexpr int SAVE_RAM_FLUSH_INTERVAL = 1000; // ms
+
+/*
+  Cartridge RAM. Battery-backed RAM lives in a shared mapping of the .sav
+  file, writes mark 512-byte blocks dirty and a background thread pushes the
+  dirty ranges to disk every flush interval and once more on destruction,
+  the emulation thread never waits on the disk.
+
+  Where the file can't be mapped the RAM is a private buffer which is only
+  written back by flush() and on destruction.
+
+  A trailer of extra bytes after the RAM goes to the file along with it, for
+  cartridge state such as the MBC3 clock.
+*/
+class SaveRAM final : public non_copyable {
+public:
+  // plain RAM, lost on power off
+  SaveRAM(size_t size);
+  SaveRAM(size_t size, const std::string &path,
+          int flush_interval = SAVE_RAM_FLUSH_INTERVAL, size_t trailer = 0);
+  ~SaveRAM();
+
+  byte *data() const { return data_; }
+  size_t size() const { return size_; }
+  byte *trailer() const { return data_ + size_; }
+  bool battery() const { return !path_.empty(); }
+
+  // called after every write to the battery-backed RAM or the trailer
+  void mark_dirty(size_t offset) {
+    auto block = offset / SAVE_RAM_BLOCK_SIZE;
+    dirty_[block / 64].fetch_or(uint64_t(1) << (block % 64),
+                                std::memory_order_relaxed);
+  }
+
+  // write the dirty blocks back now
+  void flush();
+
+private:
+  size_t bytes() const { return size_ + trailer_size_; }
+  bool map_file();
+  void load_file();
+  void flush_loop();
+
+private:
+  byte *data_;
+  size_t size_;
+  size_t trailer_size_;
+  std::string path_;
+  bool mapped_;
+  std::unique_ptr<std::atomic<uint64_t>[]> dirty_;
+  size_t dirty_words_;
+
+  int flush_interval_;
+  std::thread flusher_;
+  std::mutex flusher_mutex_;
+  std::condition_variable flusher_cv_;
+  bool stopping_;
+};
+
+typedef std::unique_ptr<SaveRAM> SaveRAMPtr;
+
+} // namespace GB
@@ -0,0 +1,102 @@
+#include "scheduler.h"
+#include <cassert>
+#include <climits>
+#include <cstring>
+
+namespace GB {
+
+Scheduler::Scheduler() : now_(0), size_(0) {
+  memset(when_, 0, sizeof(when_));
+  memset(handlers_, 0, sizeof(handlers_));
+  memset(heap_, 0, sizeof(heap_));
+  for (auto &pos : pos_) {
+    pos = -1;
+  }
+}
+
+void Scheduler::schedule(SchedulerEvent event, uint64_t when) {
+  assert(handlers_[event] != nullptr);
+  if (pos_[event] < 0) {
+    when_[event] = when;
+    place(size_, event);
+    sift_up(size_++);
+    return;
+  }
+  auto earlier = when < when_[event];
+  when_[event] = when;
+  if (earlier) {
+    sift_up(pos_[event]);
+  } else {
+    sift_down(pos_[event]);
+  }
+}
+
+void Scheduler::cancel(SchedulerEvent event) {
+  auto index = pos_[event];
+  if (index < 0) {
+    return;
+  }
+  pos_[event] = -1;
+  if (index == --size_) {
+    return;
+  }
+  auto moved = heap_[size_];
+  place(index, moved);
+  sift_down(index);
+  sift_up(pos_[moved]);
+}
+
+int Scheduler::clocks_to_next_event() const {
+  if (size_ == 0) {
+    return INT_MAX;
+  }
+  auto when = when_[heap_[0]];
+  if (when <= now_) {
+    return 0;
+  }
+  return when - now_ > INT_MAX ? INT_MAX : static_cast<int>(when - now_);
+}
+
+void Scheduler::advance(int clocks) {
+  now_ += clocks;
+  while (size_ > 0 && when_[heap_[0]] <= now_) {
+    auto event = static_cast<SchedulerEvent>(heap_[0]);
+    cancel(event);
+    // the handler is free to schedule the event (or any other) again
+    handlers_[event]->on_event(event, when_[event]);
+  }
+}
+
+void Scheduler::sift_up(int index) {
+  auto event = heap_[index];
+  while (index > 0) {
+    auto parent = (index - 1) / 2;
+    if (!before(event, heap_[parent])) {
+      break;
+    }
+    place(index, heap_[parent]);
+    index = parent;
+  }
+  place(index, event);
+}
+
+void Scheduler::sift_down(int index) {
+  auto event = heap_[index];
+  while (true) {
+    auto child = index * 2 + 1;
+    if (child >= size_) {
+      break;
+    }
+    if (child + 1 < size_ && before(heap_[child + 1], heap_[child])) {
+      ++child;
+    }
+    if (!before(heap_[child], event)) {
+      break;
+    }
+    place(index, heap_[child]);
+    index = child;
+  }
+  place(index, event);
+}
+
+} // namespace GB
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "common.h"
+#include "hardware.h"
+
+namespace GB {
+
+enum SchedulerEvent {
+  EVENT_TIMER_OVERFLOW,
+  EVENT_PPU_MODE, // the current LCD mode ends (a frame tick while LCD is off)
+  EVENT_DMA_END,
+  EVENT_SERIAL_END,
+  EVENT_MAX,
+};
+
+class IEventHandler {
+public:
+  virtual ~IEventHandler() = default;
+  // when is the clock the event was due at, the scheduler may already be a few
+  // clocks past it
+  virtual void on_event(SchedulerEvent event, uint64_t when) = 0;
+};
+
+/*
+  Cycle-timestamped events kept in a min-heap indexed by event, so that every
+  event is pending at most once and rescheduling one is a single sift.
+
+  The CPU runs freely for clocks_to_next_event() and then advances the clock,
+  which fires every event that became due in timestamp order (events due at
+  the same clock fire in SchedulerEvent order).
+*/
+class Scheduler final : public non_copyable {
+public:
+  Scheduler();
+
+  uint64_t now() const { return now_; }
+
+  void connect(SchedulerEvent event, IEventHandler *handler) {
+    handlers_[event] = handler;
+  }
+
+  // (re)schedules the event at the absolute clock when
+  void schedule(SchedulerEvent event, uint64_t when);
+  void schedule_in(SchedulerEvent event, int clocks) {
+    schedule(event, now_ + clocks);
+  }
+  void cancel(SchedulerEvent event);
+  bool scheduled(SchedulerEvent event) const { return pos_[event] >= 0; }
+
+  // clocks left before the earliest event, INT_MAX when nothing is pending
+  int clocks_to_next_event() const;
+
+  // moves the clock forward and fires the events that became due
+  void advance(int clocks);
+
+private:
+  bool before(int a, int b) const {
+    return when_[a] < when_[b] || (when_[a] == when_[b] && a < b);
+  }
+  void place(int index, int event) {
+    heap_[index] = event;
+    pos_[event] = index;
+  }
+  void sift_up(int index);
+  void sift_down(int index);
+
+private:
+  uint64_t now_;
+  uint64_t when_[EVENT_MAX];
+  IEventHandler *handlers_[EVENT_MAX];
+  int heap_[EVENT_MAX];
+  int pos_[EVENT_MAX]; // -1 when not scheduled
+  int size_;
+};
+
+} // namespace GB
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "cpu.h"
 #include "memory.h"
+#include "scheduler.h"
 
 namespace GB {
 class SR_TurnOffBootstrap final : public IPortOperator {
@@ -20,7 +22,7 @@ private:
   Memory *memory_;
 };
 
-class SR_DMA final : public IPortOperator {
+class SR_DMA final : public IPortOperator, public IEventHandler {
   /*
 Writing to this register launches a DMA transfer from ROM or RAM to
 【OAM memory】 (sprite attribute table). The written value specifies the
@@ -39,14 +41,16 @@ than 40 sprites on the screen (ie. for example 40 sprites in upper half, and
 other 40 sprites in lower half of the screen).
 */
 public:
-  SR_DMA(Memory *memory) : memory_(memory) {}
+  SR_DMA(Memory *memory, Scheduler *scheduler)
+      : memory_(memory), scheduler_(scheduler), src_(0) {
+    scheduler_->connect(SchedulerEvent::EVENT_DMA_END, this);
+  }
 
+  // the copy lands in OAM when the transfer completes
   void set_reg(a16_t addr, byte data) override {
-    a16_t src = data;
-    src <<= 8;
-    for (size_t i = 0; i < 0xA0; ++i) {
-      memory_->set(0xFE00 + i, memory_->get(src + i));
-    }
+    src_ = data;
+    src_ <<= 8;
+    scheduler_->schedule_in(SchedulerEvent::EVENT_DMA_END, DMA_CLOCKS);
   }
 
   byte get_reg(a16_t addr) const override {
@@ -54,8 +58,66 @@ public:
     return 0;
   }
 
+  void on_event(SchedulerEvent event, uint64_t when) override {
+    for (size_t i = 0; i < 0xA0; ++i) {
+      memory_->set(0xFE00 + i, memory_->get(src_ + i));
+    }
+  }
+
 private:
+  static constexpr int DMA_CLOCKS = 640; // 160 machine cycles
+
   Memory *memory_;
+  Scheduler *scheduler_;
+  a16_t src_;
+};
+
+/*
+  FF01 - SB - Serial transfer data
+  FF02 - SC - Serial Transfer Control
+    Bit 7 - Transfer Start Flag (0=No transfer is in progress or requested)
+    Bit 0 - Shift Clock (0=External Clock, 1=Internal Clock)
+  No link cable is ever plugged in: a transfer on the internal clock shifts in
+  0xFF after 8 bits at 8192Hz, one on the external clock never completes.
+*/
+class SR_Serial final : public IPortOperator, public IEventHandler {
+public:
+  SR_Serial(CPU *cpu)
+      : cpu_(cpu), scheduler_(cpu->scheduler()), data_(0), control_(0) {
+    scheduler_->connect(SchedulerEvent::EVENT_SERIAL_END, this);
+  }
+
+  void set_reg(a16_t addr, byte data) override {
+    if (addr == MappedIOPorts::REG_SB) {
+      data_ = data;
+      return;
+    }
+    control_ = data;
+    if ((control_ & 0x81) == 0x81) {
+      scheduler_->schedule_in(SchedulerEvent::EVENT_SERIAL_END,
+                              SERIAL_TRANSFER_CLOCKS);
+    } else {
+      scheduler_->cancel(SchedulerEvent::EVENT_SERIAL_END);
+    }
+  }
+
+  byte get_reg(a16_t addr) const override {
+    return addr == MappedIOPorts::REG_SB ? data_ : control_;
+  }
+
+  void on_event(SchedulerEvent event, uint64_t when) override {
+    data_ = 0xFF;
+    control_ &= 0x7F;
+    cpu_->request_interrupt(CPUInterrupts::INT_SERIAL);
+  }
+
+private:
+  static constexpr int SERIAL_TRANSFER_CLOCKS = 8 * 512;
+
+  CPU *cpu_;
+  Scheduler *scheduler_;
+  byte data_;
+  byte control_;
 };
 
 } // namespace GB
@@ -1,70 +1,112 @@
 #include "timer.h"
 #include "common.h"
 #include "cpu.h"
+#include "memory.h"
+#include <climits>
 
 namespace GB {
 
-Timer::Timer()
-    : internal_counter_(0), timer_tima_(0), timer_tima_acc_clocks_(0),
-      timer_tma_(0), timer_tac_(0) {}
-
-void Timer::set_reg(a16_t addr, byte data) {
-  switch (addr) {
-  case MappedIOPorts::REG_DIV:
-    // anything written to div will cause it to be reset to zero
-    internal_counter_ = 0;
-    break;
-  case MappedIOPorts::REG_TIMA:
-    timer_tima_ = data;
-    break;
-  case MappedIOPorts::REG_TMA:
-    timer_tma_ = data;
-    break;
-  case MappedIOPorts::REG_TAC:
-    timer_tac_ = data;
-    break;
-  default:
-    assert(0);
-  }
+Timer::Timer(CPU *cpu, Scheduler *scheduler)
+    : cpu_(cpu), scheduler_(scheduler), last_sync_(scheduler->now()),
+      internal_counter_(0), timer_tima_(0), timer_tima_acc_clocks_(0),
+      timer_tma_(0), timer_tac_(0) {
+  scheduler_->connect(SchedulerEvent::EVENT_TIMER_OVERFLOW, this);
+}
+
+void Timer::connect(Memory *memory) {
+  memory->map_port<Timer, &Timer::get_div, &Timer::set_div>(
+      MappedIOPorts::REG_DIV, this);
+  memory->map_port<Timer, &Timer::get_tima, &Timer::set_tima>(
+      MappedIOPorts::REG_TIMA, this);
+  memory->map_port<Timer, &Timer::set_tma>(MappedIOPorts::REG_TMA, this,
+                                           &timer_tma_);
+  memory->map_port<Timer, &Timer::set_tac>(MappedIOPorts::REG_TAC, this,
+                                           &timer_tac_);
 }
 
-byte Timer::get_reg(a16_t addr) const {
-  switch (addr) {
-  case MappedIOPorts::REG_DIV:
-    return static_cast<byte>(internal_counter_ >> 8);
-  case MappedIOPorts::REG_TIMA:
+// DIV and TIMA are brought up to date from the clock, TIMA can't have
+// overflowed since the last sync, that is an event
+byte Timer::get_div() const {
+  auto elapsed = scheduler_->now() - last_sync_;
+  return static_cast<byte>(uint16_t(internal_counter_ + elapsed) >> 8);
+}
+
+byte Timer::get_tima() const {
+  if (!IS_BIT_SET(timer_tac_, 2)) {
     return timer_tima_;
-  case MappedIOPorts::REG_TMA:
-    return timer_tma_;
-  case MappedIOPorts::REG_TAC:
-    return timer_tac_;
-  default:
-    assert(0);
-    return 0;
   }
+  auto elapsed = scheduler_->now() - last_sync_;
+  return timer_tima_ + ((timer_tima_acc_clocks_ + elapsed) >>
+                        TIMER_TIMA_MODES[timer_tac_ & 0x3]);
+}
+
+void Timer::set_div(byte data) {
+  sync();
+  // anything written to div will cause it to be reset to zero
+  internal_counter_ = 0;
+  reschedule();
+}
+
+void Timer::set_tima(byte data) {
+  sync();
+  timer_tima_ = data;
+  reschedule();
+}
+
+void Timer::set_tma(byte data) {
+  sync();
+  timer_tma_ = data;
+  reschedule();
+}
+
+void Timer::set_tac(byte data) {
+  sync();
+  timer_tac_ = data;
+  reschedule();
+}
+
+int Timer::clocks_to_overflow() const {
+  if (!IS_BIT_SET(timer_tac_, 2)) {
+    return INT_MAX;
+  }
+  auto related_speed = TIMER_TIMA_MODES[timer_tac_ & 0x3];
+  return ((0x100 - timer_tima_) << related_speed) - timer_tima_acc_clocks_;
+}
+
+void Timer::on_event(SchedulerEvent event, uint64_t when) {
+  sync();
+  reschedule();
+}
+
+void Timer::reschedule() {
+  if (!IS_BIT_SET(timer_tac_, 2)) {
+    scheduler_->cancel(SchedulerEvent::EVENT_TIMER_OVERFLOW);
+    return;
+  }
+  scheduler_->schedule(SchedulerEvent::EVENT_TIMER_OVERFLOW,
+                       last_sync_ + clocks_to_overflow());
 }
 
-void Timer::update(CPU *cpu, int clocks) {
+void Timer::sync() {
+  auto now = scheduler_->now();
+  auto clocks = now - last_sync_;
+  last_sync_ = now;
+
   internal_counter_ += clocks;
   auto timer_enable = IS_BIT_SET(timer_tac_, 2);
   if (!timer_enable) {
     return;
   }
-  //   debug_log(
-  //       "====internal:%04x,timer_tima_acc_clocks_:%02x,timer_tima_:%02x,timer_"
-  //       "tac_:%02x,timer_tac_:%02x==========",
-  //       internal_counter_, timer_tima_acc_clocks_, timer_tima_, timer_tac_,
-  //       timer_tac_ & 0x3);
+  // the overflow event keeps this below one wrap of TIMA
   auto related_speed = TIMER_TIMA_MODES[timer_tac_ & 0x3];
-  timer_tima_acc_clocks_ += clocks;
+  auto acc_clocks = timer_tima_acc_clocks_ + clocks;
 
-  uint16_t overflow = timer_tima_acc_clocks_ >> related_speed;
-  timer_tima_acc_clocks_ &= (1 << related_speed) - 1;
+  uint16_t overflow = acc_clocks >> related_speed;
+  timer_tima_acc_clocks_ = acc_clocks & ((1 << related_speed) - 1);
   timer_tima_ += overflow;
 
   if (timer_tima_ < overflow) {
-    // debug_log("timer interrupt!!");
-    cpu->request_interrupt(CPUInterrupts::INT_TIMER);
+    cpu_->request_interrupt(CPUInterrupts::INT_TIMER);
     timer_tima_ = timer_tac_; // load the data of TAC;
   }
 }
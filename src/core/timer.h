@@ -2,9 +2,11 @@
 
 #include "hardware.h"
 #include "memory_operator.h"
+#include "scheduler.h"
 
 namespace GB {
 class CPU;
+class Memory;
 
 /*
     00: CPU Clock / 1024 (DMG, CGB:   4096 Hz, SGB:   ~4194 Hz)
@@ -13,15 +15,37 @@ class CPU;
     11: CPU Clock / 256  (DMG, CGB:  16384 Hz, SGB:  ~16780 Hz)
 */
 constexpr uint32_t TIMER_TIMA_MODES[] = {10 /*2^10=1024*/, 4, 6, 8};
-class Timer final : public IPortOperator {
+/*
+  DIV and TIMA are not counted clock by clock. The counters are brought up to
+  date from the scheduler clock when a register is accessed, and the overflow
+  is an event scheduled from TIMA/TMA/TAC.
+*/
+class Timer final : public IEventHandler {
 public:
-  Timer();
+  Timer(CPU *cpu, Scheduler *scheduler);
+
+  void connect(Memory *memory);
+  void on_event(SchedulerEvent event, uint64_t when) override;
 
-  void set_reg(a16_t addr, byte data) override;
-  byte get_reg(a16_t addr) const override;
-  void update(CPU *cpu, int clocks);
+private:
+  byte get_div() const;
+  byte get_tima() const;
+  void set_div(byte data);
+  void set_tima(byte data);
+  void set_tma(byte data);
+  void set_tac(byte data);
+
+  // applies the clocks elapsed since the last sync
+  void sync();
+  void reschedule();
+  // clocks left before TIMA overflows, as of the last sync
+  int clocks_to_overflow() const;
 
 private:
+  CPU *cpu_;
+  Scheduler *scheduler_;
+  uint64_t last_sync_;
+
   uint16_t internal_counter_;
   uint8_t timer_tima_;
   uint16_t timer_tima_acc_clocks_;
@@ -9,39 +9,57 @@ namespace GB {
 
 VirtualMachine::VirtualMachine(SPtr<BootstrapROM> bsr, CartridgePtr cartridge,
                                SPtr<LCDDisplayer> displayer, bool debug_mode)
-    : bootstrap_rom_(bsr), cartridge_(cartridge), displayer_(displayer) {
+    : bootstrap_rom_(bsr), cartridge_(cartridge), displayer_(displayer),
+      overrun_clocks_(0) {
   memory_ = UPtr<Memory>(new Memory());
   cpu_ = UPtr<CPU>(new CPU(memory_.get(), debug_mode));
   gpu_ = UPtr<GPU>(new GPU(cpu_.get()));
   joypad_ = UPtr<Joypad>(new Joypad());
   turnoff_bootstrap_ =
       UPtr<IPortOperator>(new SR_TurnOffBootstrap(memory_.get()));
-  port_dma_ = UPtr<IPortOperator>(new SR_DMA(memory_.get()));
+  port_dma_ =
+      UPtr<IPortOperator>(new SR_DMA(memory_.get(), cpu_->scheduler()));
+  port_serial_ = UPtr<IPortOperator>(new SR_Serial(cpu_.get()));
 }
 
-VirtualMachine::~VirtualMachine() {}
+VirtualMachine::~VirtualMachine() {
+  if (cartridge_) {
+    cartridge_->connect(nullptr);
+  }
+}
 
 void VirtualMachine::connect_all_components() {
   gpu_->connect(memory_.get());
-  memory_->map_port(MappedIOPorts::REG_JOYPAD, joypad_.get());
+  memory_->map_port<Joypad, &Joypad::get_reg, &Joypad::set_reg>(
+      MappedIOPorts::REG_JOYPAD, joypad_.get());
   memory_->map_port(MappedIOPorts::REG_TURN_OFF_ROM, turnoff_bootstrap_.get());
   memory_->map_port(MappedIOPorts::REG_DMA, port_dma_.get());
+  memory_->map_port(MappedIOPorts::REG_SB, port_serial_.get());
+  memory_->map_port(MappedIOPorts::REG_SC, port_serial_.get());
 
   memory_->load_boot_rom(bootstrap_rom_.get());
   memory_->load_cartridge(cartridge_.get());
+  cartridge_->connect(cpu_->scheduler());
 
-  if (!displayer_->prepare(joypad_.get())) {
+  if (displayer_ && !displayer_->prepare(joypad_.get())) {
     return;
   }
 }
 
+void VirtualMachine::set_jit_mode(JitMode mode) { cpu_->set_jit_mode(mode); }
+
+void VirtualMachine::set_frame_skip(int frames) {
+  gpu_->set_frame_skip(frames);
+}
+
 void VirtualMachine::run() {
+  assert(displayer_);
   auto last_clock = std::chrono::high_resolution_clock::now();
   auto total_clocks = 0;
   while (true) {
-    auto cost_clocks = cpu_->update();
-    total_clocks += cost_clocks;
-    if (!gpu_->update(cost_clocks)) {
+    poll_joypad();
+    total_clocks += cpu_->update();
+    if (!gpu_->take_frame() || !gpu_->frame_drawn()) {
       continue;
     }
     //now render the current frame
@@ -55,9 +73,48 @@ void VirtualMachine::run() {
     last_clock = std::chrono::high_resolution_clock::now();
     total_clocks = 0;
 
-    cpu_->request_interrupt(CPUInterrupts::INT_V_BLANK);
-    displayer_->push_frame(gpu_->get_view());
+    if (gpu_->frame_changed()) {
+      displayer_->push_frame(gpu_->frame());
+    } else {
+      displayer_->repeat_frame();
+    }
+  }
+}
+
+uint64_t VirtualMachine::run_clocks(uint64_t clocks) {
+  uint64_t run = 0;
+  if (clocks <= overrun_clocks_) {
+    overrun_clocks_ -= clocks;
+    return run;
+  }
+  clocks -= overrun_clocks_;
+  while (run < clocks) {
+    poll_joypad();
+    run += cpu_->run_until(int(std::min<uint64_t>(clocks - run, INT_MAX)));
+  }
+  overrun_clocks_ = run - clocks;
+  return run;
+}
+
+uint64_t VirtualMachine::run_frames(int n) {
+  uint64_t run = 0;
+  while (n > 0) {
+    poll_joypad();
+    run += cpu_->update();
+    if (gpu_->take_frame()) {
+      --n;
+    }
+  }
+  return run;
+}
+
+uint64_t VirtualMachine::run_instructions(int n) {
+  uint64_t run = 0;
+  for (; n > 0; --n) {
+    poll_joypad();
+    run += cpu_->step();
   }
+  return run;
 }
 
 } // namespace GB
\ No newline at end of file
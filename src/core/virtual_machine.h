@@ -4,6 +4,7 @@
 #include "cartridge.h"
 #include "cpu.h"
 #include "gpu.h"
+#include "jit_compiler.h"
 #include "lcd_displayer.h"
 #include "memory.h"
 #include <memory>
@@ -16,8 +17,36 @@ public:
   ~VirtualMachine();
 
   void connect_all_components();
+  void set_jit_mode(JitMode mode);
+  // see GPU::set_frame_skip()
+  void set_frame_skip(int frames);
+  // runs in real time and pushes every frame drawn to the displayer, or says
+  // it is repeated, never returns; the pace is kept per frame drawn, so
+  // skipping frames runs that many times as fast
   void run();
 
+  // batch runs as fast as the host goes, without any displayer; each returns
+  // the clocks it ran
+  //
+  // run_clocks() runs for clocks less what the previous call ran over its
+  // budget, so that consecutive calls add up to exactly the clocks asked for
+  uint64_t run_clocks(uint64_t clocks);
+  // runs until n more frames are completed
+  uint64_t run_frames(int n);
+  // runs n instructions (a wait in HALT counts as one)
+  uint64_t run_instructions(int n);
+
+  // the clock of the whole run
+  uint64_t clocks() const { return cpu_->scheduler()->now(); }
+  const ScreenFrame &frame() const { return gpu_->frame(); }
+
+private:
+  void poll_joypad() {
+    if (joypad_->take_key_press()) {
+      cpu_->request_interrupt(CPUInterrupts::INT_JOYPAD);
+    }
+  }
+
 private:
   SPtr<BootstrapROM> bootstrap_rom_;
   CartridgePtr cartridge_;
@@ -30,5 +59,9 @@ private:
 
   UPtr<IPortOperator> turnoff_bootstrap_;
   UPtr<IPortOperator> port_dma_;
+  UPtr<IPortOperator> port_serial_;
+
+  // clocks the last run_clocks() ran past its budget
+  uint64_t overrun_clocks_;
 };
 } // namespace GB
\ No newline at end of file